@@ -17,12 +17,13 @@
  *    limitations under the License.
  */
 
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -33,6 +34,36 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <poll.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/perf_event.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <ctype.h>
+#include <strings.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 enum log_level
 {
@@ -50,89 +81,6336 @@ static const char *LOG_LEVELS[] =
     "DEBUG"
 };
 
+// Most verbose level compiled in; e.g. '-DNB_MIN_LEVEL=2' removes every DEBUG message
+#ifndef NB_MIN_LEVEL
+#define NB_MIN_LEVEL 3
+#endif
+
+// The level is checked before the arguments are evaluated; the flight recorder keeps every level
+#define log_enabled(level) ((level) <= NB_MIN_LEVEL && ((level) <= global_level || global_flight != NULL))
+#define log_message(level, ...) \
+    do { if (log_enabled(level)) log_emit(level, __VA_ARGS__); } while (0)
+#define log_message_at(time, level, ...) \
+    do { if (log_enabled(level)) log_emit_at(time, level, __VA_ARGS__); } while (0)
+
 static const int VERSION_MAJOR = 0;
 static const int VERSION_MINOR = 1;
 static const int VERSION_PATCH = 0;
 
 #define MAX_CONNECTIONS  50
 #define MAX_PORTS        50
+#define MAX_NAMESPACES   16
+#define MAX_LISTENERS    (MAX_PORTS * MAX_NAMESPACES)
+#define MAX_JAILS        8
+#define JAIL_BUCKETS     8
+#define JAIL_SLOTS       8192
+#define JAIL_PROBES      8
+#define MAX_TARPITS      512
+#define TARPIT_TIMEOUT   60000
+#define HOURS            24
+#define MAX_WATCHES      128
+#define MAX_SENSORS      256
+#define MAX_PEERS        64
+#define MAX_FRAME        65536
+#define SENSOR_BATCH     64
+#define SENSOR_DELAY     200
+#define SENSOR_FRAMES    1024
+#define SENSOR_RETRY     30000
+#define COLLECTOR_DELAY  2000
+#define COLLECTOR_EVENTS 65536
+#define BAN_SLOTS        16384
+#define BAN_PROBES       8
+#define MAX_GOSSIP_PEERS 16
+#define GOSSIP_DATAGRAM  1200
+#define GOSSIP_DELAY     500
+#define GOSSIP_MAX_AGE   60000
+#define GOSSIP_BLOOM     (1 << 16)
+#define GOSSIP_ROTATION  600000
+#define FIREWALL_TABLE   "net_bouncer"
+#define SKETCH_PRECISION 12
+#define SKETCH_REGISTERS (1 << SKETCH_PRECISION)
+#define SKETCH_TOP       32
+#define ARCHIVE_BLOCK    4096
+#define LOG_LINE_SIZE    1024
+#define LOG_SYNC_DELAY   1000
+#define LOG_BUFFER_SIZE  65536
+#define MAX_SINKS        8
+#define SINK_BATCH       65536
+#define SINK_QUEUE       64
+#define SINK_IOV         16
+#define SINK_RETRY       10000
+#define FLIGHT_RECORDS   8192
+#define CLOCK_SHIFT      24
+#define CLOCK_MAX_TICKS  (UINT64_C(1) << 40)
+#define CLOCK_ANCHOR_DELAY 1000
+#define ACCEPT_BATCH     64
+#define LISTEN_BUFFER    1024
+#define SOCKSTAT_PAYLOAD 16384
+#define XDP_FRAMES       2048
+#define XDP_FRAME_SIZE   2048
+#define XDP_SEEN_SYNS    1024
+#define MAX_PROXY_SOURCES 16
+#define MAX_PROXY_CLIENTS 64
+#define PROXY_HEADER_MAX 256
+#define PROXY_TIMEOUT    500
+#define CONNTRACK_BATCH  64
+#define ANOMALY_PERIOD   1000
+#define ANOMALY_WINDOW   300
+#define ANOMALY_WARMUP   30
+#define MAX_RDNS_QUERIES 32
+#define RDNS_EVENTS      1024
+#define RDNS_SLOTS       2048
+#define RDNS_PROBES      8
+#define RDNS_MESSAGE     512
+#define RDNS_MAX_TTL     86400
+#define RDNS_NEGATIVE_TTL 300
+#define RDNS_RETRY       60
+#define REPUTATION_SLOTS 65536
+#define REPUTATION_PROBES 8
+#define REPUTATION_TOP   100
+#define REPUTATION_EXPORT 60000
+#define STATSD_DATAGRAM  1432
+#define STATSD_DATAGRAMS 16
+#define STATSD_LINE      128
+#define STATSD_PREFIX    "net_bouncer"
+#define CONNTRACK_MESSAGE 2048
+#define CONNTRACK_ROUNDS 16
+#define CONNTRACK_BUFFER (16 * 1024 * 1024)
+
+// When the lines written to the log file are forced to the disk
+enum durability
+{
+    DURABILITY_NONE = 0,    // page cache only
+    DURABILITY_INTERVAL,    // fdatasync every interval on a background thread
+    DURABILITY_STRICT       // fdatasync each batch before waiting for more events
+};
+
+static const char *DURABILITY_MODES[] =
+{
+    "none",
+    "interval",
+    "strict"
+};
+
+// Formats of the lines sent to the sinks
+enum sink_format
+{
+    SINK_TEXT = 0,      // the lines of the log
+    SINK_JSON,          // one object per line with 'time', 'level' and 'message'
+    SINK_FORMATS
+};
+
+static const char *SINK_FORMAT_NAMES[] =
+{
+    "text",
+    "json"
+};
+
+// Syntax of the firewall restore file
+enum firewall_format
+{
+    FIREWALL_NFT = 0,   // 'nft -f'
+    FIREWALL_IPSET      // 'ipset restore'
+};
+
+static const char *FIREWALL_FORMATS[] =
+{
+    "nft",
+    "ipset"
+};
+
+// Frames of the protocol between sensors and the collector
+enum frame_type
+{
+    FRAME_HELLO = 1,    // sensor instance (8 bytes) and name
+    FRAME_EVENTS = 2,   // sequence number, event count, base time and the events
+    FRAME_ACK = 3       // last sequence number received by the collector
+};
+
+enum action
+{
+    ACTION_LOG    = 0x01,   // log the connection
+    ACTION_BAN    = 0x02,   // count the connection in the jails
+    ACTION_TARPIT = 0x04,   // keep the connection open until 'TARPIT_TIMEOUT'
+    ACTION_UNSET  = 0x80    // only used while compiling the rules
+};
+
+// Counters of the self profiling; the task clock leads the group because it's always available
+enum profile_counter
+{
+    PROFILE_TASK_CLOCK = 0,
+    PROFILE_CYCLES,
+    PROFILE_INSTRUCTIONS,
+    PROFILE_CACHE_MISSES,
+    PROFILE_CONTEXT_SWITCHES,
+    PROFILE_COUNTERS
+};
+
+// Stages of the event loop measured by the self profiling
+enum profile_stage
+{
+    STAGE_ACCEPT = 0,   // accepting, resolving and logging connections
+    STAGE_LOG,          // writing the logged lines
+    STAGES
+};
+
+// How the listeners accept connections
+enum listen_mode
+{
+    LISTEN_IPV4 = 0,
+    LISTEN_IPV6,
+    LISTEN_DUAL         // IPv6 sockets that also accept IPv4 connections
+};
+
+// Optional work done for each connection; there is an accept loop for every combination, which has no
+// checks for the modules it leaves out. Of the stages a pipeline usually specializes on, deduplication is
+// done here by the sketches (unique sources) and the ban set (repeat offenders), and the flight recorder
+// and the sensor copy the events elsewhere. The enrichment of the sources, by their reputation and their
+// names, stays a runtime check of its table: both are rarely enabled and cost a lookup per connection
+// anyway, while each bit would double the copies of the loop (48 now, 192 with both, 303 KB of text
+// against 173 KB). The checks of the data that changes while running, whether any ban is in force and
+// whether the port has jails, stay too.
+enum accept_feature
+{
+    FEATURE_SKETCH = 0x01,
+    FEATURE_BANS   = 0x02,
+    FEATURE_FLIGHT = 0x04,
+    FEATURE_SENSOR = 0x08
+};
+
+// IPv4 addresses are stored as IPv4-mapped IPv6 addresses
+struct source_address
+{
+    uint8_t bytes[16];
+};
+
+struct jail_entry
+{
+    struct source_address address;
+    uint32_t last_bucket;   // bucket of the most recent hit; zero means empty slot
+    uint32_t banned_until;  // first bucket after the ban expires
+    uint16_t buckets[JAIL_BUCKETS];
+};
+
+struct jail
+{
+    const char *name;
+    int ports[MAX_PORTS];
+    int port_count;
+    int max_retry;
+    int64_t epoch;
+    int64_t bucket_width;   // in milliseconds
+    uint32_t ban_buckets;
+    struct jail_entry *entries;
+};
+
+// Node of the binary prefix trie used to resolve the rule actions
+struct rule_node
+{
+    int child[2];       // zero means no child (the root is never a child)
+    uint8_t *actions;   // table indexed by listener and hour, or NULL
+};
+
+struct tarpit
+{
+    int fd;
+    int64_t deadline;
+};
+
+struct event
+{
+    int64_t time;
+    struct source_address source;
+    int port;
+    int sensor;     // only used by the collector
+};
+
+// File descriptor monitored by the main loop besides the listeners
+struct watch
+{
+    int fd;
+    short events;
+    void (*callback)(int fd, short revents);
+};
+
+struct frame
+{
+    uint64_t sequence;
+    size_t size;
+    uint8_t *data;
+};
+
+// Connection from this instance to the collector
+struct sensor
+{
+    struct sockaddr_storage address;
+    socklen_t address_size;
+    const char *name;
+    uint64_t instance;
+    int fd;
+    bool ready;
+    bool dropping;
+    int64_t retry_at;
+    int64_t backoff;
+    uint8_t output[MAX_FRAME];
+    size_t output_size;
+    size_t output_sent;
+    uint8_t input[64];
+    size_t input_size;
+    struct frame frames[SENSOR_FRAMES];
+    int frame_head;
+    int frame_count;
+    uint64_t next_sequence;
+    uint64_t sent_sequence;
+    struct event batch[SENSOR_BATCH];
+    int batch_count;
+    int64_t batch_deadline;
+};
+
+// Sensor known by the collector
+struct sensor_state
+{
+    char name[64];
+    uint64_t instance;
+    uint64_t last_sequence;
+};
+
+struct ban_entry
+{
+    struct source_address prefix;
+    int length;
+    int64_t expires;    // zero means empty slot
+};
+
+/*
+ * Ban announcements exchanged with other instances. Each datagram has a header, a list
+ * of prefixes with the ban duration and a SipHash tag computed with the shared key.
+ */
+struct gossip
+{
+    int fd;
+    uint64_t id;
+    uint8_t key[16];
+    struct sockaddr_storage peers[MAX_GOSSIP_PEERS];
+    socklen_t peer_sizes[MAX_GOSSIP_PEERS];
+    int peer_count;
+    uint8_t batch[GOSSIP_DATAGRAM];
+    size_t batch_size;
+    int64_t batch_deadline;
+    // two generations of bloom filters with the announcements seen recently
+    uint64_t bloom[2][GOSSIP_BLOOM / 64];
+    int64_t rotate_at;
+};
+
+struct top_entry
+{
+    struct source_address source;
+    uint64_t count;
+    uint64_t error;     // how much of the count may belong to other sources
+};
+
+/*
+ * Mergeable summary of the connections on one port: a HyperLogLog for the number
+ * of unique sources and a Space-Saving list of the top sources.
+ */
+struct sketch
+{
+    int port;
+    uint64_t total;
+    uint8_t registers[SKETCH_REGISTERS];
+    uint64_t hashes[SKETCH_TOP];
+    struct top_entry top[SKETCH_TOP];
+    int top_count;
+};
+
+struct sketch_set
+{
+    int64_t start;
+    int64_t end;
+    struct sketch *sketches;
+    int count;
+};
+
+// Log file written through a shared memory mapping of a preallocated segment
+struct mapped_log
+{
+    int fd;
+    char *map;
+    size_t segment_size;
+    off_t offset;       // file offset of the segment
+    size_t used;        // bytes written in the segment
+};
+
+// Connection from a balancer waiting for its PROXY protocol header
+struct proxy_client
+{
+    int fd;
+    int listener;
+    int64_t deadline;
+    struct source_address balancer;
+    size_t size;
+    uint8_t data[PROXY_HEADER_MAX];     // signature, fixed fields, addresses and TLVs
+};
+
+// Baseline of the connection rate of a port, in connections per second
+struct port_baseline
+{
+    uint64_t hits;      // counter at the previous sample
+    double mean;
+    double variance;
+    bool anomalous;
+};
+
+// Lines formatted once and shared by every sink with that format; the last sink to write them frees them
+struct sink_buffer
+{
+    int references;
+    int lines;
+    size_t size;
+    size_t capacity;
+    char *data;
+};
+
+// Additional destination of the log lines, written without blocking through its own cursor
+struct sink
+{
+    const char *target;     // 'stderr' or 'unix:path'
+    enum sink_format format;
+    int fd;
+    bool socket;
+    struct sink_buffer *queue[SINK_QUEUE];  // ring
+    int head;
+    int count;
+    size_t cursor;          // bytes of the first buffer already written
+    uint64_t dropped;       // lines lost because the sink was full or disconnected
+    int64_t retry_at;
+};
+
+struct rdns_query
+{
+    struct source_address source;
+    uint16_t id;
+    int64_t deadline;   // zero means free slot
+};
+
+// Connection waiting for the name of its source
+struct rdns_event
+{
+    struct source_address source;
+    int64_t time;
+    int port;
+    const char *tag;
+    char detail[64];
+};
+
+struct rdns_entry
+{
+    struct source_address source;
+    int64_t expires;    // zero means empty slot
+    char name[256];     // empty if the source has no name or the query failed
+};
+
+/*
+ * Client of a DNS resolver for the PTR names of the sources. The connections are logged in
+ * order, each one once the name of its source is known or after the timeout.
+ */
+struct rdns
+{
+    int fd;
+    uint8_t key[16];        // query IDs are the SipHash of a counter, so sending one takes no system call
+    uint64_t sent;
+    struct rdns_query queries[MAX_RDNS_QUERIES];
+    struct rdns_event events[RDNS_EVENTS];  // ring
+    int event_head;
+    int event_count;
+    struct rdns_entry cache[RDNS_SLOTS];
+};
+
+// Score of a source as of 'time'; it halves every half-life and is only decayed when the source comes back
+struct reputation_entry
+{
+    struct source_address source;
+    float score;        // zero means empty slot
+    uint32_t time;      // seconds since 'global_reputation_epoch'
+};
+
+// Durations aggregated between StatsD flushes, in nanoseconds
+struct statsd_timer
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+// StatsD client; the counters are the differences since the previous flush
+struct statsd
+{
+    int fd;
+    uint64_t hits[MAX_PORTS];
+    uint64_t log_lines;
+    uint64_t dropped;
+    uint64_t bans;
+    struct statsd_timer wakeup;     // handling the events of each wake up
+    char datagrams[STATSD_DATAGRAMS][STATSD_DATAGRAM];
+    size_t sizes[STATSD_DATAGRAMS];
+    int count;
+};
+
+// Ring shared with the kernel by an AF_XDP socket; the indexes run freely and wrap at 2^32
+struct xdp_ring
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *entries;
+    void *map;
+    size_t map_size;
+};
 
-static bool global_running = true;
+// AF_XDP socket receiving the SYNs redirected by the XDP program, and the frames they're written to
+struct xdp_engine
+{
+    int fd;
+    int map_fd;
+    int program_fd;
+    int link_fd;
+    uint8_t *umem;
+    struct xdp_ring fill;
+    struct xdp_ring completion;
+    struct xdp_ring rx;
+    uint64_t seen[XDP_SEEN_SYNS];   // hashes of recent SYNs, so retransmissions aren't counted again
+};
+
+// Counter group of one stage of the event loop
+struct profile_group
+{
+    int fds[PROFILE_COUNTERS];          // -1 for counters that couldn't be opened
+    int slots[PROFILE_COUNTERS];        // position in the group read
+    int count;
+    uint64_t previous[PROFILE_COUNTERS];
+    int64_t cpu_start;                  // without counters, thread CPU time is measured instead
+    uint64_t cpu_total;
+};
+
+// Kinds of records kept by the flight recorder
+enum flight_kind
+{
+    FLIGHT_MESSAGE = 1,     // log message, even if its level is filtered out
+    FLIGHT_CONNECTION,      // accepted connection and the actions applied to it
+    FLIGHT_BANNED           // connection from a banned source, closed silently
+};
+
+// One cache line per record; the ring is overwritten from the oldest record
+struct flight_record
+{
+    int64_t time;
+    uint32_t sequence;
+    uint8_t kind;
+    uint8_t level;          // log level of messages, actions of connections
+    uint16_t port;
+    union
+    {
+        uint8_t source[16];
+        char text[48];
+    } data;
+};
+
+typedef char flight_record_is_a_cache_line[sizeof(struct flight_record) == 64 ? 1 : -1];
+
+struct buffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+};
+
+// Columns of the archive blocks
+enum archive_column
+{
+    COLUMN_TIME = 0,    // delta-of-delta of the timestamps
+    COLUMN_KIND,        // run-length encoded line kind and log level
+    COLUMN_PORT,        // block dictionary of ports followed by references to it
+    COLUMN_ADDRESS,     // references to the file dictionary of addresses
+    COLUMN_TEXT,        // anything else
+    COLUMN_COUNT
+};
+
+enum line_kind
+{
+    LINE_RAW = 0,           // line without timestamp, stored as is
+    LINE_MESSAGE,           // timestamp, level and message
+    LINE_CONNECTION,        // timestamp, level, address and port
+    LINE_CONNECTION_SUFFIX  // same as above plus the text after the port
+};
+
+struct archive_writer
+{
+    FILE *file;
+    uint64_t offset;
+    struct buffer columns[COLUMN_COUNT];
+    uint8_t kinds[ARCHIVE_BLOCK];
+    int ports[ARCHIVE_BLOCK];
+    int lines;
+    int64_t previous_time;
+    int64_t previous_delta;
+    int64_t first_time;
+    int64_t last_time;
+    bool has_time;
+    // dictionary of addresses (a hash table of indices plus the addresses in order)
+    struct source_address *addresses;
+    uint32_t address_count;
+    uint32_t *slots;
+    uint32_t slot_count;
+    struct buffer index;
+    uint64_t block_count;
+};
+
+// Connection from a sensor to the collector
+struct peer
+{
+    int fd;
+    int sensor;
+    size_t input_size;
+    uint8_t input[MAX_FRAME + 16];
+};
+
+static volatile sig_atomic_t global_running = 1;
+static volatile sig_atomic_t global_stop_signal = 0;
 static const char *global_log_file = NULL;
+static struct sink global_sinks[MAX_SINKS];
+static int global_sink_count = 0;
+static struct sink_buffer *global_sink_batches[SINK_FORMATS];
+static unsigned int global_sink_formats = 0;    // bit mask of the formats used by the sinks
 static FILE *global_log = NULL;
+static struct mapped_log global_mapped_log = { -1, NULL, 0, 0, 0 };
+static size_t global_log_segment = 0;
+static int64_t global_log_sync_deadline = 0;
+static volatile sig_atomic_t global_reopen = 0;
+static const char *global_flight_file = NULL;
+static struct flight_record *global_flight = NULL;
+static uint64_t global_flight_sequence = 0;
+static long global_flight_utc_offset = 0;
+static volatile sig_atomic_t global_flight_dump = 0;
+static bool global_clock_started = false;
+static bool global_clock_tsc = false;
+static uint64_t global_clock_anchor_ticks = 0;
+static int64_t global_clock_anchor_ns = 0;
+static int64_t global_clock_anchor_raw = 0;     // CLOCK_MONOTONIC_RAW at the anchor, which NTP never steps or slews
+static uint64_t global_clock_mult = 0;          // nanoseconds per tick << CLOCK_SHIFT
+static int64_t global_clock_offset_ns = 0;      // wall clock minus the coarse monotonic clock
+static int64_t global_clock_deadline = 0;
+static bool global_clock_info = false;
+static long global_workload = 0;
+static int global_sockstat = 0;
+static const char *global_xdp_interface = NULL;
+static int global_xdp_queue = 0;
+static struct xdp_engine *global_xdp = NULL;
+static struct source_address global_proxy_sources[MAX_PROXY_SOURCES];
+static int global_proxy_lengths[MAX_PROXY_SOURCES];
+static int global_proxy_source_count = 0;
+static struct proxy_client global_proxy_clients[MAX_PROXY_CLIENTS];
+static int global_proxy_client_count = 0;
+static double global_anomaly_threshold = 0;
+static struct port_baseline global_baselines[MAX_PORTS];
+static int64_t global_anomaly_deadline = 0;
+static int64_t global_anomaly_time = 0;
+static uint64_t global_anomaly_samples = 0;
+static const char *global_rdns_target = NULL;
+static int global_rdns_timeout = 500;
+static struct rdns *global_rdns = NULL;
+static double global_reputation_threshold = 0;
+static int global_reputation_half_life = 3600;
+static const char *global_reputation_file = NULL;
+static struct reputation_entry *global_reputations = NULL;
+static int64_t global_reputation_epoch = 0;
+static int64_t global_reputation_deadline = 0;
+static const char *global_statsd_target = NULL;
+static int global_statsd_interval = 10;
+static struct statsd *global_statsd = NULL;
+static int64_t global_statsd_deadline = 0;
+static uint64_t global_dropped = 0;     // connections from banned sources
+static uint64_t global_ban_count = 0;
+static bool global_conntrack = false;
+static int global_conntrack_fd = -1;
+static uint64_t global_conntrack_lost = 0;
+static int global_stats_interval = 0;
+static int64_t global_stats_deadline = 0;
+static bool global_profile_counters = false;
+static struct profile_group global_profile[STAGES];
+static uint64_t global_log_lines = 0;
+static uint64_t global_stats_events[STAGES];
+static long global_stats_switches = 0;
+static enum durability global_durability = DURABILITY_NONE;
+static int global_sync_interval = 1000;
+static bool global_log_pending = false;
+// the sync thread holds the lock while it uses the file descriptor of the log
+static pthread_mutex_t global_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t global_sync_wake;
+static pthread_t global_sync_thread;
+static bool global_sync_running = false;
 static enum log_level global_level = LOG_INFO;
 static int global_family = AF_INET;
+static bool global_dual_stack = false;
+static unsigned int global_features = 0;                // 'accept_feature' bits chosen by 'accept_select'
 static int global_ports[MAX_PORTS];
 static int global_port_count = 0;
+static const char *global_namespaces[MAX_NAMESPACES];
+static char global_namespace_tags[MAX_NAMESPACES][NAME_MAX + 16];
+static int global_namespace_count = 0;
+static int global_listener_count = 0;
+static int global_listener_ports[MAX_LISTENERS];        // index in 'global_ports'
+static const char *global_listener_tags[MAX_LISTENERS];  // appended to the connection lines
+static struct jail global_jails[MAX_JAILS];
+static int global_jail_count = 0;
+static uint8_t global_port_jails[MAX_PORTS];
+static uint8_t global_hash_key[16];
+static const char *global_rules_file = NULL;
+static struct rule_node *global_rule_nodes = NULL;
+static int global_rule_node_count = 0;
+static int global_hour = 0;
+static int64_t global_hour_end = 0;
+static struct tarpit global_tarpits[MAX_TARPITS];
+static int global_tarpit_head = 0;
+static int global_tarpit_count = 0;
+static uint64_t global_hits[MAX_PORTS];
+static struct watch global_watches[MAX_WATCHES];
+static int global_watch_count = 0;
+static const char *global_sensor_target = NULL;
+static const char *global_sensor_name = NULL;
+static struct sensor *global_sensor = NULL;
+static int global_collector_port = 0;
+static int global_collector_fd = -1;
+static struct sensor_state global_sensor_states[MAX_SENSORS];
+static int global_sensor_state_count = 0;
+static struct peer *global_peers[MAX_PEERS];
+static int global_peer_count = 0;
+static struct event *global_merge_heap = NULL;
+static int global_merge_count = 0;
+static struct ban_entry *global_bans = NULL;
+static int global_ban_length_count[129];
+static int global_ban_lengths[129];
+static int global_ban_length_total = 0;
+static const char *global_gossip_targets[MAX_GOSSIP_PEERS];
+static int global_gossip_target_count = 0;
+static int global_gossip_port = 0;
+static const char *global_gossip_key_file = NULL;
+static struct gossip *global_gossip = NULL;
+static const char *global_firewall_file = NULL;
+static enum firewall_format global_firewall_format = FIREWALL_NFT;
+static int global_firewall_interval = 10;
+static int64_t global_firewall_deadline = 0;
+static uint64_t global_firewall_digest = 0;
+static bool global_firewall_written = false;
+static const char *global_sketch_file = NULL;
+static int global_sketch_interval = 300;
+static struct sketch_set global_sketches = {0};
+static int64_t global_sketch_deadline = 0;
+static const char *global_merge_output = NULL;
+static bool global_show_sketches = false;
+static const char *global_archive_output = NULL;
+static const char *global_extract_input = NULL;
+static const char *global_extract_from = NULL;
+static const char *global_extract_to = NULL;
 
-int64_t current_time_ms()
+static int64_t clock_read_ns(clockid_t id)
 {
     struct timespec tv;
-    clock_gettime(CLOCK_REALTIME, &tv);
-    return tv.tv_sec * 1000 + tv.tv_nsec / 1000000;
+    clock_gettime(id, &tv);
+    return (int64_t) tv.tv_sec * 1000000000 + tv.tv_nsec;
 }
 
-static void log_message(enum log_level level, const char *format, ...)
+// Only a TSC that ticks at a constant rate in every power state can measure time
+static bool clock_tsc_invariant()
 {
-    if (level > global_level || level < 0)
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+        return false;
+    return (edx & (1u << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+static uint64_t clock_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Tie the fast clock to the wall clock again, which absorbs the adjustments made by NTP
+static void clock_anchor()
+{
+    if (!global_clock_tsc)
+    {
+        global_clock_offset_ns = clock_read_ns(CLOCK_REALTIME) - clock_read_ns(CLOCK_MONOTONIC_COARSE);
         return;
+    }
+    uint64_t before = clock_ticks();
+    int64_t raw = clock_read_ns(CLOCK_MONOTONIC_RAW);
+    int64_t now = clock_read_ns(CLOCK_REALTIME);
+    uint64_t ticks = before + (clock_ticks() - before) / 2;
 
-    // time
-    int64_t now = current_time_ms();
-    time_t t = now / 1000;
-    char date[64];
-    struct tm tm;
-    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
-    fprintf(global_log, "%s.%03lu [%s] ", date, now % 1000, LOG_LEVELS[level]);
+    // calibrate the rate against the raw hardware clock since the previous anchor, so a step or a slew
+    // of the wall clock only moves the offset
+    uint64_t elapsed_ticks = ticks - global_clock_anchor_ticks;
+    int64_t elapsed_ns = raw - global_clock_anchor_raw;
+    if (global_clock_anchor_ticks != 0 && elapsed_ns >= 10000000 && elapsed_ticks > 0 && elapsed_ticks < CLOCK_MAX_TICKS)
+        global_clock_mult = ((uint64_t) elapsed_ns << CLOCK_SHIFT) / elapsed_ticks;
+    global_clock_anchor_ticks = ticks;
+    global_clock_anchor_raw = raw;
+    global_clock_anchor_ns = now;
+}
 
-    // message
-    va_list args;
-    va_start(args, format);
-    vfprintf(global_log, format, args);
-    va_end(args);
-    fputc('\n', global_log);
-    fflush(global_log);
+static int64_t clock_fast_ns()
+{
+    if (!global_clock_started)
+        return clock_read_ns(CLOCK_REALTIME);
+    if (!global_clock_tsc)
+        return clock_read_ns(CLOCK_MONOTONIC_COARSE) + global_clock_offset_ns;
+    uint64_t elapsed = clock_ticks() - global_clock_anchor_ticks;
+    // the product would overflow after a long time without anchoring
+    if (elapsed >= CLOCK_MAX_TICKS)
+        return clock_read_ns(CLOCK_REALTIME);
+    return global_clock_anchor_ns + (int64_t) ((elapsed * global_clock_mult) >> CLOCK_SHIFT);
 }
 
-static void log_connection_ipv4( enum log_level level, const struct sockaddr_in *source, int port )
+// Choose the source of the fast clock and calibrate it
+static void clock_start()
 {
-    char address[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &source->sin_addr, address, sizeof(struct sockaddr_in));
-    log_message(level, "Connection from %s on port %d", address, port);
+    global_clock_tsc = clock_tsc_invariant();
+    clock_anchor();
+    if (global_clock_tsc)
+    {
+        struct timespec delay = { 0, 20000000 };
+        nanosleep(&delay, NULL);
+        clock_anchor();
+        global_clock_tsc = global_clock_mult != 0;
+        if (!global_clock_tsc)
+            clock_anchor();
+    }
+    global_clock_started = true;
+    global_clock_deadline = clock_fast_ns() / 1000000 + CLOCK_ANCHOR_DELAY;
 }
 
-static void log_connection_ipv6( enum log_level level, const struct sockaddr_in6 *source, int port )
+int64_t current_time_ms()
 {
-    char address[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &source->sin6_addr, address, sizeof(struct sockaddr_in6));
-    log_message(level, "Connection from %s on port %d", address, port);
+    return clock_fast_ns() / 1000000;
 }
 
-static void log_error(const char *message, int err)
+// Find the end of the text, ignoring the zeros preallocated for a segment that wasn't truncated
+static off_t mapped_log_end(int fd, off_t size)
 {
-    log_message(LOG_ERROR, "%s: %s", message, strerror(err));
+    char data[65536];
+    while (size > 0)
+    {
+        size_t chunk = (size_t) size < sizeof(data) ? (size_t) size : sizeof(data);
+        if (pread(fd, data, chunk, size - (off_t) chunk) != (ssize_t) chunk)
+            break;
+        size_t length = chunk;
+        while (length > 0 && data[length - 1] == 0)
+            --length;
+        if (length > 0)
+            return size - (off_t) chunk + (off_t) length;
+        size -= (off_t) chunk;
+    }
+    return size;
+}
+
+// Map a new segment starting at the page that contains 'end'
+static bool mapped_log_map(struct mapped_log *log, off_t end)
+{
+    off_t page = (off_t) sysconf(_SC_PAGESIZE);
+    log->offset = end - end % page;
+    log->used = (size_t) (end - log->offset);
+    int result = fallocate(log->fd, 0, log->offset, (off_t) log->segment_size);
+    if (result != 0 && errno == EOPNOTSUPP)
+    {
+        struct stat info;
+        result = fstat(log->fd, &info);
+        if (result == 0 && info.st_size < log->offset + (off_t) log->segment_size)
+            result = ftruncate(log->fd, log->offset + (off_t) log->segment_size);
+    }
+    if (result != 0)
+        return false;
+    void *map = mmap(NULL, log->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, log->offset);
+    if (map == MAP_FAILED)
+        return false;
+    log->map = map;
+    return true;
+}
+
+static void mapped_log_close(struct mapped_log *log)
+{
+    if (log->fd < 0)
+        return;
+    off_t end = log->offset + (off_t) log->used;
+    if (log->map != NULL)
+    {
+        msync(log->map, log->segment_size, MS_ASYNC);
+        munmap(log->map, log->segment_size);
+        log->map = NULL;
+    }
+    // remove the preallocated space that wasn't used
+    if (ftruncate(log->fd, end) != 0)
+        fprintf(stderr, "Unable to truncate the log file: %s\n", strerror(errno));
+    close(log->fd);
+    log->fd = -1;
+}
+
+static bool mapped_log_open(struct mapped_log *log, const char *path, size_t segment_size)
+{
+    struct stat info;
+    log->segment_size = segment_size;
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd < 0 || fstat(log->fd, &info) != 0 || !mapped_log_map(log, mapped_log_end(log->fd, info.st_size)))
+    {
+        int err = errno;
+        log->offset = 0;
+        log->used = 0;
+        if (log->fd >= 0)
+            close(log->fd);
+        log->fd = -1;
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+static bool mapped_log_append(struct mapped_log *log, const char *data, size_t size)
+{
+    if (log->used + size > log->segment_size)
+    {
+        off_t end = log->offset + (off_t) log->used;
+        msync(log->map, log->segment_size, MS_ASYNC);
+        munmap(log->map, log->segment_size);
+        log->map = NULL;
+        if (!mapped_log_map(log, end) || log->used + size > log->segment_size)
+            return false;
+    }
+    memcpy(log->map + log->used, data, size);
+    log->used += size;
+    return true;
+}
+
+static bool log_open()
+{
+    if (global_log_file == NULL)
+    {
+        global_log = stderr;
+        return true;
+    }
+    bool result;
+    pthread_mutex_lock(&global_sync_lock);
+    if (global_log_segment > 0)
+        result = mapped_log_open(&global_mapped_log, global_log_file, global_log_segment);
+    else
+    {
+        global_log = fopen(global_log_file, "at");
+        result = global_log != NULL;
+        // lines are flushed in batches by log_commit
+        if (result)
+            setvbuf(global_log, NULL, _IOFBF, LOG_BUFFER_SIZE);
+    }
+    pthread_mutex_unlock(&global_sync_lock);
+    return result;
+}
+
+static void log_close()
+{
+    pthread_mutex_lock(&global_sync_lock);
+    if (global_durability != DURABILITY_NONE && global_log_pending)
+    {
+        if (global_log != NULL && global_log != stderr)
+            fflush(global_log);
+        if (global_mapped_log.fd >= 0)
+            fdatasync(global_mapped_log.fd);
+        else if (global_log != NULL && global_log != stderr)
+            fdatasync(fileno(global_log));
+    }
+    global_log_pending = false;
+    mapped_log_close(&global_mapped_log);
+    if (global_log != NULL && global_log != stderr)
+        fclose(global_log);
+    // late messages, like a second signal during shutdown, still go somewhere
+    global_log = stderr;
+    pthread_mutex_unlock(&global_sync_lock);
+}
+
+// File descriptor of the log file, or -1 when logging to 'stderr'; the caller holds the sync lock
+static int log_fd()
+{
+    if (global_mapped_log.fd >= 0)
+        return global_mapped_log.fd;
+    if (global_log != NULL && global_log != stderr)
+        return fileno(global_log);
+    return -1;
+}
+
+// Hand the lines written since the last call to the kernel, and to the disk in strict mode
+static void sink_seal(int64_t now);
+static void sink_line(enum log_level level, const char *line, size_t length, size_t message);
+
+static void log_commit()
+{
+    if (global_sink_count > 0)
+        sink_seal(current_time_ms());
+    if (!global_log_pending)
+        return;
+    global_log_pending = false;
+    if (global_mapped_log.map == NULL && fflush(global_log) != 0)
+        return;
+    if (global_durability == DURABILITY_STRICT)
+    {
+        // fdatasync also writes back the pages dirtied through the mapping
+        int fd = log_fd();
+        if (fd >= 0 && fdatasync(fd) != 0)
+            fprintf(stderr, "Unable to sync the log file: %s\n", strerror(errno));
+    }
+}
+
+static void log_write(const char *data, size_t size)
+{
+    if (global_mapped_log.map != NULL)
+    {
+        if (mapped_log_append(&global_mapped_log, data, size))
+        {
+            global_log_pending = true;
+            ++global_log_lines;
+            return;
+        }
+        // keep logging through the regular file
+        int err = errno;
+        log_close();
+        global_log_segment = 0;
+        if (!log_open())
+            global_log = stderr;
+        fprintf(global_log, "Unable to map the log file (%s); using regular writes\n", strerror(err));
+    }
+    fwrite(data, 1, size, global_log);
+    global_log_pending = true;
+    ++global_log_lines;
+}
+
+// Flight recorder
+
+static void flight_record(const struct flight_record *record)
+{
+    struct flight_record *slot = &global_flight[global_flight_sequence % FLIGHT_RECORDS];
+    *slot = *record;
+    slot->sequence = (uint32_t) global_flight_sequence++;
+}
+
+static void flight_message(int64_t now, enum log_level level, const char *format, va_list args)
+{
+    struct flight_record record;
+    record.time = now;
+    record.kind = FLIGHT_MESSAGE;
+    record.level = (uint8_t) level;
+    record.port = 0;
+    vsnprintf(record.data.text, sizeof(record.data.text), format, args);
+    flight_record(&record);
+}
+
+static void flight_connection(enum flight_kind kind, const struct source_address *source, int port, uint8_t action, int64_t now)
+{
+    struct flight_record record;
+    record.time = now;
+    record.kind = (uint8_t) kind;
+    record.level = action;
+    record.port = (uint16_t) port;
+    memcpy(record.data.source, source->bytes, sizeof(record.data.source));
+    flight_record(&record);
+}
+
+// The dump runs in signal handlers, so it only uses async-signal-safe calls and formats by hand
+
+static size_t flight_append(char *output, size_t length, const char *text)
+{
+    while (*text != 0 && length < LOG_LINE_SIZE)
+        output[length++] = *text++;
+    return length;
+}
+
+static size_t flight_append_number(char *output, size_t length, uint64_t value, int width, int base)
+{
+    char digits[24];
+    int count = 0;
+    do
+    {
+        digits[count++] = "0123456789abcdef"[value % (uint64_t) base];
+        value /= (uint64_t) base;
+    }
+    while (value > 0 && count < (int) sizeof(digits));
+    while (count < width && count < (int) sizeof(digits))
+        digits[count++] = '0';
+    while (count > 0 && length < LOG_LINE_SIZE)
+        output[length++] = digits[--count];
+    return length;
+}
+
+static size_t flight_append_time(char *output, size_t length, int64_t time)
+{
+    int64_t seconds = time / 1000 + global_flight_utc_offset;
+    int64_t days = seconds / 86400;
+    int64_t rest = seconds % 86400;
+
+    // civil date from the days since 1970-01-01
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t day_of_era = z - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t month_index = (5 * day_of_year + 2) / 153;
+    int64_t day = day_of_year - (153 * month_index + 2) / 5 + 1;
+    int64_t month = month_index < 10 ? month_index + 3 : month_index - 9;
+    int64_t year = year_of_era + era * 400 + (month <= 2);
+
+    length = flight_append_number(output, length, (uint64_t) year, 4, 10);
+    length = flight_append(output, length, "-");
+    length = flight_append_number(output, length, (uint64_t) month, 2, 10);
+    length = flight_append(output, length, "-");
+    length = flight_append_number(output, length, (uint64_t) day, 2, 10);
+    length = flight_append(output, length, " ");
+    length = flight_append_number(output, length, (uint64_t) (rest / 3600), 2, 10);
+    length = flight_append(output, length, ":");
+    length = flight_append_number(output, length, (uint64_t) (rest / 60 % 60), 2, 10);
+    length = flight_append(output, length, ":");
+    length = flight_append_number(output, length, (uint64_t) (rest % 60), 2, 10);
+    length = flight_append(output, length, ".");
+    return flight_append_number(output, length, (uint64_t) (time % 1000), 3, 10);
+}
+
+static size_t flight_append_source(char *output, size_t length, const uint8_t *bytes)
+{
+    static const uint8_t MAPPED[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    if (memcmp(bytes, MAPPED, sizeof(MAPPED)) == 0)
+    {
+        for (int i = 12; i < 16; ++i)
+        {
+            if (i > 12)
+                length = flight_append(output, length, ".");
+            length = flight_append_number(output, length, bytes[i], 1, 10);
+        }
+        return length;
+    }
+    // all the groups, without compressing the zeros
+    for (int i = 0; i < 16; i += 2)
+    {
+        if (i > 0)
+            length = flight_append(output, length, ":");
+        length = flight_append_number(output, length, (uint64_t) (bytes[i] << 8 | bytes[i + 1]), 1, 16);
+    }
+    return length;
+}
+
+// Write the records to the dump file, from the oldest to the newest
+static int flight_dump()
+{
+    int fd = open(global_flight_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    uint64_t count = global_flight_sequence < FLIGHT_RECORDS ? global_flight_sequence : FLIGHT_RECORDS;
+    for (uint64_t i = global_flight_sequence - count; i != global_flight_sequence; ++i)
+    {
+        const struct flight_record *record = &global_flight[i % FLIGHT_RECORDS];
+        char line[LOG_LINE_SIZE + 1];
+        size_t length = flight_append_time(line, 0, record->time);
+        if (record->kind == FLIGHT_MESSAGE)
+        {
+            length = flight_append(line, length, " [");
+            length = flight_append(line, length, record->level <= LOG_DEBUG ? LOG_LEVELS[record->level] : "?");
+            length = flight_append(line, length, "] ");
+            char text[sizeof(record->data.text) + 1];
+            memcpy(text, record->data.text, sizeof(record->data.text));
+            text[sizeof(record->data.text)] = 0;
+            length = flight_append(line, length, text);
+        }
+        else
+        {
+            length = flight_append(line, length, record->kind == FLIGHT_BANNED ? " [BANNED] " : " [CONNECTION] ");
+            length = flight_append_source(line, length, record->data.source);
+            length = flight_append(line, length, " on port ");
+            length = flight_append_number(line, length, record->port, 1, 10);
+            if (record->kind == FLIGHT_CONNECTION)
+            {
+                length = flight_append(line, length, (record->level & ACTION_LOG) ? " log" : " count");
+                if (record->level & ACTION_BAN)
+                    length = flight_append(line, length, " ban");
+                if (record->level & ACTION_TARPIT)
+                    length = flight_append(line, length, " tarpit");
+            }
+        }
+        line[length++] = '\n';
+        if (write(fd, line, length) < 0)
+            break;
+    }
+    close(fd);
+    return (int) count;
+}
+
+static void flight_crash_handler(int signum)
+{
+    flight_dump();
+    // the handler was reset, so the signal now terminates the process as usual
+    raise(signum);
+}
+
+static void flight_dump_handler(int signum)
+{
+    (void) signum;
+    global_flight_dump = 1;
+}
+
+static void log_vmessage(int64_t now, enum log_level level, const char *format, va_list args)
+{
+    if (global_flight != NULL && level >= 0)
+    {
+        va_list copy;
+        va_copy(copy, args);
+        flight_message(now, level, format, copy);
+        va_end(copy);
+    }
+    if (level > global_level || level < 0)
+        return;
+
+    // time
+    time_t t = now / 1000;
+    char line[LOG_LINE_SIZE];
+    struct tm tm;
+    size_t length = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    length += (size_t) snprintf(line + length, sizeof(line) - length, ".%03d [%s] ", (int) (now % 1000), LOG_LEVELS[level]);
+
+    // message
+    size_t message = length;
+    int result = vsnprintf(line + length, sizeof(line) - length, format, args);
+    if (result > 0)
+        length += (size_t) result < sizeof(line) - length ? (size_t) result : sizeof(line) - length - 1;
+    line[length++] = '\n';
+    log_write(line, length);
+    if (global_sink_count > 0)
+        sink_line(level, line, length, message);
+}
+
+static void log_emit(enum log_level level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_vmessage(current_time_ms(), level, format, args);
+    va_end(args);
+}
+
+// Log a message with the given timestamp instead of the current time
+static void log_emit_at(int64_t time, enum log_level level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_vmessage(time, level, format, args);
+    va_end(args);
+}
+
+static void log_error(const char *message, int err)
+{
+    log_message(LOG_ERROR, "%s: %s", message, strerror(err));
+}
+
+static void *sync_thread(void *argument)
+{
+    (void) argument;
+    pthread_mutex_lock(&global_sync_lock);
+    while (global_sync_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += global_sync_interval / 1000;
+        deadline.tv_nsec += (long) (global_sync_interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (global_sync_running && pthread_cond_timedwait(&global_sync_wake, &global_sync_lock, &deadline) != ETIMEDOUT)
+            ;
+        // syncs whatever the main thread already committed to the kernel
+        int fd = log_fd();
+        if (fd >= 0)
+            fdatasync(fd);
+    }
+    pthread_mutex_unlock(&global_sync_lock);
+    return NULL;
+}
+
+static bool sync_start()
+{
+    if (global_durability != DURABILITY_INTERVAL)
+        return true;
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&global_sync_wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    global_sync_running = true;
+    int err = pthread_create(&global_sync_thread, NULL, sync_thread, NULL);
+    if (err != 0)
+    {
+        global_sync_running = false;
+        log_error("Unable to start the log sync thread", err);
+        return false;
+    }
+    return true;
+}
+
+static void sync_stop()
+{
+    if (!global_sync_running)
+        return;
+    pthread_mutex_lock(&global_sync_lock);
+    global_sync_running = false;
+    pthread_cond_signal(&global_sync_wake);
+    pthread_mutex_unlock(&global_sync_lock);
+    pthread_join(global_sync_thread, NULL);
+    pthread_cond_destroy(&global_sync_wake);
+}
+
+static bool flight_start()
+{
+    if (posix_memalign((void **) &global_flight, 64, FLIGHT_RECORDS * sizeof(struct flight_record)) != 0)
+    {
+        log_message(LOG_ERROR, "Unable to allocate memory for the flight recorder");
+        return false;
+    }
+    memset(global_flight, 0, FLIGHT_RECORDS * sizeof(struct flight_record));
+
+    // the dump can't call localtime, so it uses the offset from the start
+    time_t now = time(NULL);
+    struct tm tm;
+    global_flight_utc_offset = localtime_r(&now, &tm)->tm_gmtoff;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = flight_dump_handler;
+    sigaction(SIGUSR2, &action, NULL);
+    action.sa_handler = flight_crash_handler;
+    action.sa_flags = (int) SA_RESETHAND;
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+    sigaction(SIGILL, &action, NULL);
+    sigaction(SIGFPE, &action, NULL);
+    return true;
+}
+
+static void source_from_ipv4(const struct in_addr *address, struct source_address *source)
+{
+    memset(source, 0, sizeof(*source));
+    source->bytes[10] = source->bytes[11] = 0xFF;
+    memcpy(source->bytes + 12, address, 4);
+}
+
+static bool source_is_ipv4(const struct source_address *source)
+{
+    static const uint8_t PREFIX[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+    return memcmp(source->bytes, PREFIX, sizeof(PREFIX)) == 0;
+}
+
+static const char *format_source(const struct source_address *source, char *output, size_t size)
+{
+    if (source_is_ipv4(source))
+        return inet_ntop(AF_INET, source->bytes + 12, output, (socklen_t) size);
+    return inet_ntop(AF_INET6, source->bytes, output, (socklen_t) size);
+}
+
+static void random_bytes(void *output, size_t size)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0)
+    {
+        ssize_t result = read(fd, output, size);
+        close(fd);
+        if (result == (ssize_t) size)
+            return;
+    }
+    // not really random, but still better than a fixed key
+    uint64_t state = (uint64_t) current_time_ms() ^ ((uint64_t) getpid() << 32);
+    for (size_t i = 0; i < size; ++i)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        ((uint8_t *) output)[i] = (uint8_t) (state >> 56);
+    }
+}
+
+#define ROTL64(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+static uint64_t read_le64(const uint8_t *data)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+// SipHash-2-4; source addresses are chosen by attackers, so the hash tables need a keyed hash
+static uint64_t siphash(const void *input, size_t size, const uint8_t key[16])
+{
+    const uint8_t *data = (const uint8_t *) input;
+    uint64_t k0 = read_le64(key);
+    uint64_t k1 = read_le64(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    const uint8_t *end = data + (size & ~(size_t) 7);
+    for (; data != end; data += 8)
+    {
+        uint64_t m = read_le64(data);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t last = (uint64_t) size << 56;
+    for (size_t i = 0; i < (size & 7); ++i)
+        last |= (uint64_t) data[i] << (8 * i);
+    v3 ^= last;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t jail_entry_activity(const struct jail_entry *entry)
+{
+    return entry->last_bucket > entry->banned_until ? entry->last_bucket : entry->banned_until;
+}
+
+static struct jail_entry *jail_lookup(struct jail *jail, const struct source_address *source)
+{
+    uint64_t hash = siphash(source, sizeof(*source), global_hash_key);
+    struct jail_entry *victim = NULL;
+    for (uint64_t i = 0; i < JAIL_PROBES; ++i)
+    {
+        struct jail_entry *entry = &jail->entries[(hash + i) & (JAIL_SLOTS - 1)];
+        if (entry->last_bucket == 0)
+        {
+            victim = entry;
+            break;
+        }
+        if (memcmp(&entry->address, source, sizeof(*source)) == 0)
+            return entry;
+        // prefer to evict the least recently active source
+        if (victim == NULL || jail_entry_activity(entry) < jail_entry_activity(victim))
+            victim = entry;
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    victim->address = *source;
+    return victim;
+}
+
+/*
+ * Count a connection in the jail's sliding window and return whether the source
+ * just exceeded the limit. The window is a ring of time buckets covering 'findtime'.
+ */
+static bool jail_hit(struct jail *jail, const struct source_address *source, int64_t now)
+{
+    // the wall clock may be stepped back before the epoch, or before the last hit of the source,
+    // which must not wrap the bucket number nor count into a bucket that was already cleared
+    int64_t elapsed = now > jail->epoch ? now - jail->epoch : 0;
+    uint32_t bucket = (uint32_t) (elapsed / jail->bucket_width) + 1;
+    struct jail_entry *entry = jail_lookup(jail, source);
+    if (bucket < entry->last_bucket)
+        bucket = entry->last_bucket;
+
+    // clear the buckets that went out of the window since the last hit
+    if (entry->last_bucket + JAIL_BUCKETS <= bucket)
+        memset(entry->buckets, 0, sizeof(entry->buckets));
+    else
+    {
+        for (uint32_t b = entry->last_bucket + 1; b <= bucket; ++b)
+            entry->buckets[b % JAIL_BUCKETS] = 0;
+    }
+    entry->last_bucket = bucket;
+    if (entry->buckets[bucket % JAIL_BUCKETS] < UINT16_MAX)
+        ++entry->buckets[bucket % JAIL_BUCKETS];
+
+    if (entry->banned_until > bucket)
+        return false;
+    int hits = 0;
+    for (int b = 0; b < JAIL_BUCKETS; ++b)
+        hits += entry->buckets[b];
+    if (hits < jail->max_retry)
+        return false;
+    entry->banned_until = bucket + jail->ban_buckets;
+    return true;
+}
+
+static int rule_node_create()
+{
+    struct rule_node *nodes = realloc(global_rule_nodes, sizeof(struct rule_node) * (size_t) (global_rule_node_count + 1));
+    if (nodes == NULL)
+        return -1;
+    global_rule_nodes = nodes;
+    memset(&nodes[global_rule_node_count], 0, sizeof(struct rule_node));
+    return global_rule_node_count++;
+}
+
+// Return the node of the given prefix, creating it (and its action table) if needed
+static struct rule_node *rule_node_insert(const struct source_address *prefix, int length)
+{
+    int current = 0;
+    for (int bit = 0; bit < length; ++bit)
+    {
+        int branch = (prefix->bytes[bit / 8] >> (7 - bit % 8)) & 1;
+        if (global_rule_nodes[current].child[branch] == 0)
+        {
+            int node = rule_node_create();
+            if (node < 0)
+                return NULL;
+            global_rule_nodes[current].child[branch] = node;
+        }
+        current = global_rule_nodes[current].child[branch];
+    }
+
+    struct rule_node *node = &global_rule_nodes[current];
+    if (node->actions == NULL)
+    {
+        node->actions = malloc(MAX_PORTS * HOURS);
+        if (node->actions == NULL)
+            return NULL;
+        memset(node->actions, ACTION_UNSET, MAX_PORTS * HOURS);
+    }
+    return node;
+}
+
+// Fill the unset entries of each table with the ones from the closest shorter prefix
+static void rule_node_inherit(int index, const uint8_t *parent)
+{
+    struct rule_node *node = &global_rule_nodes[index];
+    if (node->actions != NULL)
+    {
+        for (int i = 0; i < MAX_PORTS * HOURS; ++i)
+        {
+            if (node->actions[i] & ACTION_UNSET)
+                node->actions[i] = parent[i];
+        }
+        parent = node->actions;
+    }
+    for (int branch = 0; branch < 2; ++branch)
+    {
+        if (global_rule_nodes[index].child[branch] != 0)
+            rule_node_inherit(global_rule_nodes[index].child[branch], parent);
+    }
+}
+
+static bool parse_prefix(char *text, struct source_address *prefix, int *length)
+{
+    char *slash = strchr(text, '/');
+    if (slash != NULL)
+        *slash++ = 0;
+
+    memset(prefix, 0, sizeof(*prefix));
+    int max_length = 128;
+    if (inet_pton(AF_INET, text, prefix->bytes + 12) == 1)
+    {
+        prefix->bytes[10] = prefix->bytes[11] = 0xFF;
+        max_length = 32;
+    }
+    else
+    if (inet_pton(AF_INET6, text, prefix->bytes) != 1)
+        return false;
+
+    *length = slash ? atoi(slash) : max_length;
+    if (*length < 0 || *length > max_length)
+        return false;
+    // IPv4 prefixes live under '::ffff:0:0/96'
+    if (max_length == 32)
+        *length += 96;
+    return true;
+}
+
+static bool parse_rule(char *line, int number)
+{
+    char *saveptr = NULL;
+    char *actions = strtok_r(line, " \t\r\n", &saveptr);
+    if (actions == NULL || actions[0] == '#')
+        return true;
+    char *ports = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (ports == NULL)
+    {
+        log_message(LOG_ERROR, "Missing ports in rule at line %d", number);
+        return false;
+    }
+
+    // actions
+    uint8_t action = 0;
+    char *context = NULL;
+    for (char *name = strtok_r(actions, ",", &context); name != NULL; name = strtok_r(NULL, ",", &context))
+    {
+        if (strcmp(name, "log") == 0)
+            action |= ACTION_LOG;
+        else
+        if (strcmp(name, "ban") == 0)
+            action |= ACTION_BAN;
+        else
+        if (strcmp(name, "tarpit") == 0)
+            action |= ACTION_TARPIT;
+        else
+        if (strcmp(name, "count") != 0)
+        {
+            log_message(LOG_ERROR, "Invalid action '%s' at line %d", name, number);
+            return false;
+        }
+    }
+
+    // ports
+    bool listeners[MAX_PORTS] = {false};
+    context = NULL;
+    for (char *port = strtok_r(ports, ",", &context); port != NULL; port = strtok_r(NULL, ",", &context))
+    {
+        for (int p = 0; p < global_port_count; ++p)
+        {
+            if (strcmp(port, "*") == 0 || global_ports[p] == atoi(port))
+                listeners[p] = true;
+        }
+    }
+
+    // optional source prefix and time of day
+    struct source_address prefix;
+    memset(&prefix, 0, sizeof(prefix));
+    int length = 0;
+    bool hours[HOURS];
+    for (int h = 0; h < HOURS; ++h)
+        hours[h] = true;
+    for (char *key = strtok_r(NULL, " \t\r\n", &saveptr); key != NULL; key = strtok_r(NULL, " \t\r\n", &saveptr))
+    {
+        char *value = strtok_r(NULL, " \t\r\n", &saveptr);
+        if (value != NULL && strcmp(key, "from") == 0)
+        {
+            if (!parse_prefix(value, &prefix, &length))
+            {
+                log_message(LOG_ERROR, "Invalid prefix '%s' at line %d", value, number);
+                return false;
+            }
+        }
+        else
+        if (value != NULL && strcmp(key, "hours") == 0)
+        {
+            int first = -1, last = -1;
+            if (sscanf(value, "%d-%d", &first, &last) != 2 || first < 0 || first >= HOURS || last < 0 || last >= HOURS)
+            {
+                log_message(LOG_ERROR, "Invalid hours '%s' at line %d", value, number);
+                return false;
+            }
+            // ranges like '22-6' wrap around midnight
+            for (int h = 0; h < HOURS; ++h)
+                hours[h] = first <= last ? (h >= first && h <= last) : (h >= first || h <= last);
+        }
+        else
+        {
+            log_message(LOG_ERROR, "Invalid rule at line %d", number);
+            return false;
+        }
+    }
+
+    struct rule_node *node = rule_node_insert(&prefix, length);
+    if (node == NULL)
+    {
+        log_message(LOG_ERROR, "Unable to allocate memory for the rules");
+        return false;
+    }
+    for (int p = 0; p < global_port_count; ++p)
+    {
+        for (int h = 0; h < HOURS && listeners[p]; ++h)
+        {
+            if (hours[h])
+                node->actions[p * HOURS + h] = action;
+        }
+    }
+    return true;
+}
+
+/*
+ * Compile the rules into a per-listener action table (the root of the trie) plus
+ * one table for each source prefix. Each table is completed with the entries of
+ * the closest shorter prefix, so a single longest prefix match resolves the action.
+ */
+static bool load_rules(const char *path)
+{
+    if (rule_node_create() < 0 || rule_node_insert(&(struct source_address) {{0}}, 0) == NULL)
+        return false;
+
+    if (path != NULL)
+    {
+        FILE *input = fopen(path, "rt");
+        if (input == NULL)
+        {
+            log_message(LOG_ERROR, "Unable to open rules file '%s'", path);
+            return false;
+        }
+        char line[512];
+        int number = 0;
+        bool result = true;
+        while (result && fgets(line, sizeof(line), input) != NULL)
+            result = parse_rule(line, ++number);
+        fclose(input);
+        if (!result)
+            return false;
+    }
+
+    // by default, connections are logged and counted in the jails
+    uint8_t *root = global_rule_nodes[0].actions;
+    for (int i = 0; i < MAX_PORTS * HOURS; ++i)
+    {
+        if (root[i] & ACTION_UNSET)
+            root[i] = ACTION_LOG | ACTION_BAN;
+    }
+    rule_node_inherit(0, root);
+    return true;
+}
+
+static uint8_t resolve_action(int listener, const struct source_address *source, int64_t now)
+{
+    // the local time is only computed once per hour
+    if (now >= global_hour_end)
+    {
+        time_t t = now / 1000;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        global_hour = tm.tm_hour;
+        global_hour_end = now - now % 1000 - (tm.tm_min * 60 + tm.tm_sec) * 1000 + 3600 * 1000;
+    }
+
+    // longest prefix match
+    const uint8_t *actions = global_rule_nodes[0].actions;
+    int current = 0;
+    for (int bit = 0; bit < 128 && global_rule_node_count > 1; ++bit)
+    {
+        current = global_rule_nodes[current].child[(source->bytes[bit / 8] >> (7 - bit % 8)) & 1];
+        if (current == 0)
+            break;
+        if (global_rule_nodes[current].actions != NULL)
+            actions = global_rule_nodes[current].actions;
+    }
+    return actions[listener * HOURS + global_hour];
+}
+
+static void tarpit_expire(int64_t now)
+{
+    while (global_tarpit_count > 0 && global_tarpits[global_tarpit_head].deadline <= now)
+    {
+        close(global_tarpits[global_tarpit_head].fd);
+        global_tarpit_head = (global_tarpit_head + 1) % MAX_TARPITS;
+        --global_tarpit_count;
+    }
+}
+
+// Keep the connection open without ever answering; the oldest one is released if there's no room
+static void tarpit_add(int fd, int64_t now)
+{
+    if (global_tarpit_count == MAX_TARPITS)
+        tarpit_expire(global_tarpits[global_tarpit_head].deadline);
+    struct tarpit *tarpit = &global_tarpits[(global_tarpit_head + global_tarpit_count) % MAX_TARPITS];
+    tarpit->fd = fd;
+    tarpit->deadline = now + TARPIT_TIMEOUT;
+    ++global_tarpit_count;
+}
+
+static bool watch_add(int fd, short events, void (*callback)(int fd, short revents))
+{
+    if (global_watch_count >= MAX_WATCHES)
+        return false;
+    global_watches[global_watch_count].fd = fd;
+    global_watches[global_watch_count].events = events;
+    global_watches[global_watch_count].callback = callback;
+    ++global_watch_count;
+    return true;
+}
+
+static struct watch *watch_find(int fd)
+{
+    for (int i = 0; i < global_watch_count; ++i)
+    {
+        if (global_watches[i].fd == fd)
+            return &global_watches[i];
+    }
+    return NULL;
+}
+
+static void watch_remove(int fd)
+{
+    struct watch *watch = watch_find(fd);
+    if (watch != NULL)
+        *watch = global_watches[--global_watch_count];
+}
+
+static void watch_set_events(int fd, short events)
+{
+    struct watch *watch = watch_find(fd);
+    if (watch != NULL)
+        watch->events = events;
+}
+
+static bool set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Sinks
+
+static void sink_release(struct sink_buffer *buffer)
+{
+    if (--buffer->references > 0)
+        return;
+    free(buffer->data);
+    free(buffer);
+}
+
+static void sink_append(enum sink_format format, const char *data, size_t size)
+{
+    struct sink_buffer *buffer = global_sink_batches[format];
+    if (buffer == NULL)
+    {
+        if ((buffer = calloc(1, sizeof(struct sink_buffer))) == NULL || (buffer->data = malloc(SINK_BATCH)) == NULL)
+        {
+            free(buffer);
+            return;
+        }
+        buffer->references = 1;
+        buffer->capacity = SINK_BATCH;
+        global_sink_batches[format] = buffer;
+    }
+    // the batch only grows while no sink holds it
+    if (buffer->size + size > buffer->capacity)
+    {
+        char *data_grown = realloc(buffer->data, buffer->capacity * 2);
+        if (data_grown == NULL)
+            return;
+        buffer->data = data_grown;
+        buffer->capacity *= 2;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    ++buffer->lines;
+}
+
+// Add a log line to the batch of every format in use; 'message' is the offset of the text after the level
+static void sink_line(enum log_level level, const char *line, size_t length, size_t message)
+{
+    if (global_sink_formats & (1u << SINK_TEXT))
+        sink_append(SINK_TEXT, line, length);
+    if (global_sink_formats & (1u << SINK_JSON))
+    {
+        char json[LOG_LINE_SIZE * 2 + 64];
+        // the timestamp is the first 23 characters of the line
+        size_t size = (size_t) snprintf(json, sizeof(json), "{\"time\":\"%.23s\",\"level\":\"%s\",\"message\":\"", line, LOG_LEVELS[level]);
+        for (size_t i = message; i < length - 1 && size < sizeof(json) - 16; ++i)
+        {
+            unsigned char c = (unsigned char) line[i];
+            if (c == '"' || c == '\\')
+            {
+                json[size++] = '\\';
+                json[size++] = (char) c;
+            }
+            else if (c < 0x20)
+                size += (size_t) snprintf(json + size, sizeof(json) - size, "\\u%04x", c);
+            else
+                json[size++] = (char) c;
+        }
+        memcpy(json + size, "\"}\n", 3);
+        sink_append(SINK_JSON, json, size + 3);
+    }
+}
+
+static void sink_event(int fd, short revents);
+
+static void sink_disconnect(struct sink *sink, int err)
+{
+    watch_remove(sink->fd);
+    close(sink->fd);
+    sink->fd = -1;
+    sink->retry_at = current_time_ms() + SINK_RETRY;
+    for (; sink->count > 0; --sink->count)
+    {
+        sink->dropped += (uint64_t) sink->queue[sink->head]->lines;
+        sink_release(sink->queue[sink->head]);
+        sink->head = (sink->head + 1) % SINK_QUEUE;
+    }
+    sink->cursor = 0;
+    log_message(LOG_ERROR, "Lost the sink '%s': %s", sink->target, strerror(err));
+}
+
+static bool sink_connect(struct sink *sink)
+{
+    if (strcmp(sink->target, "stderr") == 0)
+    {
+        // a file description of its own, so 'stderr' stays blocking for the rest of the program
+        struct stat status;
+        sink->socket = fstat(STDERR_FILENO, &status) == 0 && S_ISSOCK(status.st_mode);
+        sink->fd = sink->socket ? dup(STDERR_FILENO) : open("/proc/self/fd/2", O_WRONLY | O_APPEND | O_NONBLOCK);
+        return sink->fd >= 0;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", sink->target + 5);
+    sink->socket = true;
+    sink->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sink->fd >= 0 && connect(sink->fd, (const struct sockaddr *) &address, sizeof(address)) == 0 && set_non_blocking(sink->fd))
+        return true;
+    if (sink->fd >= 0)
+        close(sink->fd);
+    sink->fd = -1;
+    return false;
+}
+
+// Write as much of the queue as the sink takes without blocking, and wait for it to take more
+static void sink_write(struct sink *sink)
+{
+    while (sink->count > 0)
+    {
+        struct iovec vectors[SINK_IOV];
+        int count = 0;
+        for (; count < sink->count && count < SINK_IOV; ++count)
+        {
+            const struct sink_buffer *buffer = sink->queue[(sink->head + count) % SINK_QUEUE];
+            size_t skip = count == 0 ? sink->cursor : 0;
+            vectors[count].iov_base = buffer->data + skip;
+            vectors[count].iov_len = buffer->size - skip;
+        }
+        ssize_t written;
+        if (sink->socket)
+        {
+            struct msghdr header;
+            memset(&header, 0, sizeof(header));
+            header.msg_iov = vectors;
+            header.msg_iovlen = (size_t) count;
+            written = sendmsg(sink->fd, &header, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        else
+            written = writev(sink->fd, vectors, count);
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written < 0)
+        {
+            sink_disconnect(sink, errno);
+            return;
+        }
+
+        // release the buffers written completely
+        size_t remaining = (size_t) written;
+        while (sink->count > 0 && remaining >= sink->queue[sink->head]->size - sink->cursor)
+        {
+            remaining -= sink->queue[sink->head]->size - sink->cursor;
+            sink_release(sink->queue[sink->head]);
+            sink->head = (sink->head + 1) % SINK_QUEUE;
+            --sink->count;
+            sink->cursor = 0;
+        }
+        sink->cursor += remaining;
+    }
+
+    if (sink->count > 0 && watch_find(sink->fd) == NULL && !watch_add(sink->fd, POLLOUT, sink_event))
+        sink_disconnect(sink, ENOSPC);
+    else if (sink->count == 0)
+        watch_remove(sink->fd);
+}
+
+static void sink_event(int fd, short revents)
+{
+    for (int s = 0; s < global_sink_count; ++s)
+    {
+        struct sink *sink = &global_sinks[s];
+        if (sink->fd != fd)
+            continue;
+        if (revents & (POLLERR | POLLHUP))
+            sink_disconnect(sink, EPIPE);
+        else
+            sink_write(sink);
+        return;
+    }
+}
+
+// Hand the batch of each format to the sinks that use it and start writing them
+static void sink_seal(int64_t now)
+{
+    for (int format = 0; format < SINK_FORMATS; ++format)
+    {
+        struct sink_buffer *buffer = global_sink_batches[format];
+        if (buffer == NULL)
+            continue;
+        global_sink_batches[format] = NULL;
+        for (int s = 0; s < global_sink_count; ++s)
+        {
+            struct sink *sink = &global_sinks[s];
+            if (sink->format != (enum sink_format) format)
+                continue;
+            if (sink->fd < 0 && (now < sink->retry_at || !sink_connect(sink)))
+            {
+                sink->retry_at = now + SINK_RETRY;
+                sink->dropped += (uint64_t) buffer->lines;
+                continue;
+            }
+            // a slow sink loses lines instead of holding memory or the event loop
+            if (sink->count == SINK_QUEUE)
+            {
+                sink->dropped += (uint64_t) buffer->lines;
+                continue;
+            }
+            sink->queue[(sink->head + sink->count) % SINK_QUEUE] = buffer;
+            ++sink->count;
+            ++buffer->references;
+            if (watch_find(sink->fd) == NULL)
+                sink_write(sink);
+        }
+        sink_release(buffer);
+    }
+}
+
+static bool sink_start()
+{
+    for (int s = 0; s < global_sink_count; ++s)
+    {
+        struct sink *sink = &global_sinks[s];
+        log_message(LOG_INFO, "Sending the log lines to '%s' as %s", sink->target, SINK_FORMAT_NAMES[sink->format]);
+        if (sink_connect(sink))
+            continue;
+        if (!sink->socket)
+        {
+            log_error("Unable to open the sink", errno);
+            return false;
+        }
+        // the reader of a socket may start later
+        log_message(LOG_WARNING, "Unable to connect to the sink '%s' (%s); retrying every %d seconds", sink->target, strerror(errno), SINK_RETRY / 1000);
+        sink->retry_at = current_time_ms() + SINK_RETRY;
+    }
+    return true;
+}
+
+static void sink_stop()
+{
+    // one last try for the lines still queued
+    sink_seal(current_time_ms());
+    for (int s = 0; s < global_sink_count; ++s)
+    {
+        struct sink *sink = &global_sinks[s];
+        if (sink->fd >= 0)
+        {
+            sink_write(sink);
+            for (; sink->count > 0; --sink->count)
+            {
+                sink->dropped += (uint64_t) sink->queue[sink->head]->lines;
+                sink_release(sink->queue[sink->head]);
+                sink->head = (sink->head + 1) % SINK_QUEUE;
+            }
+            watch_remove(sink->fd);
+            close(sink->fd);
+            sink->fd = -1;
+        }
+        if (sink->dropped > 0)
+            log_message(LOG_WARNING, "The sink '%s' lost %" PRIu64 " lines", sink->target, sink->dropped);
+    }
+    for (int format = 0; format < SINK_FORMATS; ++format)
+    {
+        if (global_sink_batches[format] != NULL)
+            sink_release(global_sink_batches[format]);
+        global_sink_batches[format] = NULL;
+    }
+    global_sink_count = 0;
+}
+
+static uint8_t *write_varint(uint8_t *output, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *output++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *output++ = (uint8_t) value;
+    return output;
+}
+
+// Return NULL if the input ends before the value or the value is too long
+static const uint8_t *read_varint(const uint8_t *input, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; input < end && shift < 64; shift += 7)
+    {
+        *value |= (uint64_t) (*input & 0x7F) << shift;
+        if ((*input++ & 0x80) == 0)
+            return input;
+    }
+    return NULL;
+}
+
+static uint64_t zigzag_encode(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static void write_le64(uint8_t *output, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i, value >>= 8)
+        output[i] = (uint8_t) value;
+}
+
+// Return the size of the frame header written in 'output'
+static size_t write_frame_header(uint8_t *output, enum frame_type type, size_t size)
+{
+    output[0] = (uint8_t) type;
+    return (size_t) (write_varint(output + 1, size) - output);
+}
+
+/*
+ * Parse the frame at the beginning of the buffer. Return the size of the whole frame,
+ * zero if the frame is incomplete or -1 if the frame is invalid.
+ */
+static int read_frame(const uint8_t *input, size_t size, enum frame_type *type, const uint8_t **payload, size_t *payload_size)
+{
+    if (size < 2)
+        return 0;
+    uint64_t length = 0;
+    const uint8_t *start = read_varint(input + 1, input + size, &length);
+    if (start == NULL)
+        return size > 11 ? -1 : 0;
+    if (length > MAX_FRAME)
+        return -1;
+    if ((size_t) (start - input) + length > size)
+        return 0;
+    *type = (enum frame_type) input[0];
+    *payload = start;
+    *payload_size = (size_t) length;
+    return (int) ((size_t) (start - input) + length);
+}
+
+static bool parse_endpoint(const char *text, struct sockaddr_storage *address, socklen_t *size)
+{
+    char host[256];
+    const char *port = strrchr(text, ':');
+    if (port == NULL || (size_t) (port - text) >= sizeof(host))
+        return false;
+    // IPv6 addresses are written as '[address]:port'
+    const char *start = text;
+    size_t length = (size_t) (port - text);
+    if (text[0] == '[' && port[-1] == ']')
+    {
+        ++start;
+        length -= 2;
+    }
+    memcpy(host, start, length);
+    host[length] = 0;
+
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port + 1, &hints, &result) != 0 || result == NULL)
+        return false;
+    memcpy(address, result->ai_addr, result->ai_addrlen);
+    *size = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static void sensor_event(int fd, short revents);
+
+static void sensor_disconnect(int64_t now)
+{
+    struct sensor *sensor = global_sensor;
+    if (sensor->fd >= 0)
+    {
+        watch_remove(sensor->fd);
+        close(sensor->fd);
+    }
+    log_message(LOG_WARNING, "Unable to send events to the collector; retrying in %d seconds", (int) (sensor->backoff / 1000));
+    sensor->fd = -1;
+    sensor->ready = false;
+    sensor->output_size = sensor->output_sent = sensor->input_size = 0;
+    sensor->retry_at = now + sensor->backoff;
+    sensor->backoff = sensor->backoff * 2 > SENSOR_RETRY ? SENSOR_RETRY : sensor->backoff * 2;
+}
+
+static void sensor_connect(int64_t now)
+{
+    struct sensor *sensor = global_sensor;
+    sensor->fd = socket(sensor->address.ss_family, SOCK_STREAM, 0);
+    if (sensor->fd < 0 || !set_non_blocking(sensor->fd) ||
+        (connect(sensor->fd, (const struct sockaddr *) &sensor->address, sensor->address_size) < 0 && errno != EINPROGRESS) ||
+        !watch_add(sensor->fd, POLLIN | POLLOUT, sensor_event))
+    {
+        if (sensor->fd >= 0)
+            close(sensor->fd);
+        sensor->fd = -1;
+        sensor_disconnect(now);
+        return;
+    }
+
+    // the handshake tells which frames the collector already has
+    size_t length = strlen(sensor->name);
+    uint8_t *output = sensor->output;
+    output += write_frame_header(output, FRAME_HELLO, 8 + length);
+    write_le64(output, sensor->instance);
+    memcpy(output + 8, sensor->name, length);
+    sensor->output_size = (size_t) (output - sensor->output) + 8 + length;
+}
+
+// Encode the pending events as a frame waiting for acknowledgement
+static void sensor_flush_batch()
+{
+    struct sensor *sensor = global_sensor;
+    if (sensor->batch_count == 0)
+        return;
+
+    uint8_t payload[SENSOR_BATCH * 40 + 32];
+    uint8_t *output = write_varint(payload, sensor->next_sequence);
+    output = write_varint(output, (uint64_t) sensor->batch_count);
+    output = write_varint(output, (uint64_t) sensor->batch[0].time);
+    int64_t previous = sensor->batch[0].time;
+    for (int i = 0; i < sensor->batch_count; ++i)
+    {
+        const struct event *event = &sensor->batch[i];
+        output = write_varint(output, zigzag_encode(event->time - previous));
+        output = write_varint(output, (uint64_t) event->port);
+        previous = event->time;
+        if (source_is_ipv4(&event->source))
+        {
+            *output++ = 4;
+            memcpy(output, event->source.bytes + 12, 4);
+            output += 4;
+        }
+        else
+        {
+            *output++ = 6;
+            memcpy(output, event->source.bytes, 16);
+            output += 16;
+        }
+    }
+    sensor->batch_count = 0;
+
+    size_t payload_size = (size_t) (output - payload);
+    uint8_t header[16];
+    size_t header_size = write_frame_header(header, FRAME_EVENTS, payload_size);
+    uint8_t *data = malloc(header_size + payload_size);
+    if (data == NULL)
+        return;
+    memcpy(data, header, header_size);
+    memcpy(data + header_size, payload, payload_size);
+
+    // keep the memory bounded while the collector is unreachable
+    if (sensor->frame_count == SENSOR_FRAMES)
+    {
+        if (!sensor->dropping)
+            log_message(LOG_WARNING, "Too many events waiting for the collector; dropping the oldest ones");
+        sensor->dropping = true;
+        free(sensor->frames[sensor->frame_head].data);
+        sensor->frame_head = (sensor->frame_head + 1) % SENSOR_FRAMES;
+        --sensor->frame_count;
+    }
+    struct frame *frame = &sensor->frames[(sensor->frame_head + sensor->frame_count) % SENSOR_FRAMES];
+    frame->sequence = sensor->next_sequence++;
+    frame->size = header_size + payload_size;
+    frame->data = data;
+    ++sensor->frame_count;
+}
+
+// Forget the frames already received by the collector
+static void sensor_acknowledge(uint64_t sequence)
+{
+    struct sensor *sensor = global_sensor;
+    while (sensor->frame_count > 0 && sensor->frames[sensor->frame_head].sequence <= sequence)
+    {
+        free(sensor->frames[sensor->frame_head].data);
+        sensor->frame_head = (sensor->frame_head + 1) % SENSOR_FRAMES;
+        --sensor->frame_count;
+        sensor->dropping = false;
+    }
+    if (sequence > sensor->sent_sequence)
+        sensor->sent_sequence = sequence;
+}
+
+static void sensor_pump()
+{
+    struct sensor *sensor = global_sensor;
+    if (sensor->fd < 0)
+        return;
+
+    // copy the frames not sent yet to the output buffer
+    for (int i = 0; sensor->ready && i < sensor->frame_count; ++i)
+    {
+        const struct frame *frame = &sensor->frames[(sensor->frame_head + i) % SENSOR_FRAMES];
+        if (frame->sequence <= sensor->sent_sequence)
+            continue;
+        if (sensor->output_size + frame->size > sizeof(sensor->output))
+            break;
+        memcpy(sensor->output + sensor->output_size, frame->data, frame->size);
+        sensor->output_size += frame->size;
+        sensor->sent_sequence = frame->sequence;
+    }
+
+    while (sensor->output_sent < sensor->output_size)
+    {
+        ssize_t result = send(sensor->fd, sensor->output + sensor->output_sent, sensor->output_size - sensor->output_sent, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                sensor_disconnect(current_time_ms());
+            break;
+        }
+        sensor->output_sent += (size_t) result;
+    }
+    if (sensor->fd >= 0 && sensor->output_sent == sensor->output_size)
+        sensor->output_size = sensor->output_sent = 0;
+    if (sensor->fd >= 0)
+        watch_set_events(sensor->fd, (short) (POLLIN | (sensor->output_size > 0 ? POLLOUT : 0)));
+}
+
+static void sensor_event(int fd, short revents)
+{
+    struct sensor *sensor = global_sensor;
+    if (revents & POLLIN)
+    {
+        ssize_t result = recv(fd, sensor->input + sensor->input_size, sizeof(sensor->input) - sensor->input_size, 0);
+        if (result <= 0)
+        {
+            sensor_disconnect(current_time_ms());
+            return;
+        }
+        sensor->input_size += (size_t) result;
+
+        enum frame_type type;
+        const uint8_t *payload = NULL;
+        size_t payload_size = 0;
+        int size = 0;
+        while ((size = read_frame(sensor->input, sensor->input_size, &type, &payload, &payload_size)) > 0)
+        {
+            uint64_t sequence = 0;
+            if (type != FRAME_ACK || read_varint(payload, payload + payload_size, &sequence) == NULL)
+            {
+                sensor_disconnect(current_time_ms());
+                return;
+            }
+            if (!sensor->ready)
+            {
+                // resume after the last frame the collector received
+                log_message(LOG_INFO, "Connected to the collector");
+                sensor->ready = true;
+                sensor->backoff = 1000;
+                sensor->sent_sequence = 0;
+            }
+            sensor_acknowledge(sequence);
+            sensor->input_size -= (size_t) size;
+            memmove(sensor->input, sensor->input + size, sensor->input_size);
+        }
+        if (size < 0)
+        {
+            sensor_disconnect(current_time_ms());
+            return;
+        }
+    }
+    else
+    if (revents & (POLLERR | POLLHUP))
+    {
+        sensor_disconnect(current_time_ms());
+        return;
+    }
+    sensor_pump();
+}
+
+static void sensor_add_event(const struct source_address *source, int port, int64_t now)
+{
+    struct sensor *sensor = global_sensor;
+    struct event *event = &sensor->batch[sensor->batch_count++];
+    event->time = now;
+    event->source = *source;
+    event->port = port;
+    if (sensor->batch_count == 1)
+        sensor->batch_deadline = now + SENSOR_DELAY;
+    if (sensor->batch_count == SENSOR_BATCH)
+    {
+        sensor_flush_batch();
+        sensor_pump();
+    }
+}
+
+static bool sensor_start()
+{
+    struct sensor *sensor = calloc(1, sizeof(struct sensor));
+    if (sensor == NULL)
+        return false;
+    if (!parse_endpoint(global_sensor_target, &sensor->address, &sensor->address_size))
+    {
+        log_message(LOG_ERROR, "Invalid collector address '%s'", global_sensor_target);
+        free(sensor);
+        return false;
+    }
+    static char hostname[64];
+    if (global_sensor_name == NULL && gethostname(hostname, sizeof(hostname) - 1) == 0)
+        global_sensor_name = hostname;
+    sensor->name = global_sensor_name ? global_sensor_name : "unknown";
+    random_bytes(&sensor->instance, sizeof(sensor->instance));
+    sensor->fd = -1;
+    sensor->backoff = 1000;
+    sensor->next_sequence = 1;
+    global_sensor = sensor;
+    return true;
+}
+
+static void sensor_stop()
+{
+    if (global_sensor == NULL)
+        return;
+    // best effort to send the last events
+    sensor_flush_batch();
+    sensor_pump();
+    if (global_sensor->fd >= 0)
+        close(global_sensor->fd);
+    for (int i = 0; i < global_sensor->frame_count; ++i)
+        free(global_sensor->frames[(global_sensor->frame_head + i) % SENSOR_FRAMES].data);
+    free(global_sensor);
+    global_sensor = NULL;
+}
+
+static void merge_heap_push(const struct event *event)
+{
+    int index = global_merge_count++;
+    while (index > 0 && global_merge_heap[(index - 1) / 2].time > event->time)
+    {
+        global_merge_heap[index] = global_merge_heap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    global_merge_heap[index] = *event;
+}
+
+static struct event merge_heap_pop()
+{
+    struct event top = global_merge_heap[0];
+    struct event last = global_merge_heap[--global_merge_count];
+    int index = 0;
+    for (;;)
+    {
+        int child = index * 2 + 1;
+        if (child >= global_merge_count)
+            break;
+        if (child + 1 < global_merge_count && global_merge_heap[child + 1].time < global_merge_heap[child].time)
+            ++child;
+        if (global_merge_heap[child].time >= last.time)
+            break;
+        global_merge_heap[index] = global_merge_heap[child];
+        index = child;
+    }
+    if (global_merge_count > 0)
+        global_merge_heap[index] = last;
+    return top;
+}
+
+static void collector_emit()
+{
+    struct event event = merge_heap_pop();
+    char address[INET6_ADDRSTRLEN];
+    log_message_at(event.time, LOG_INFO, "Connection from %s on port %d (sensor %s)",
+        format_source(&event.source, address, sizeof(address)), event.port, global_sensor_states[event.sensor].name);
+}
+
+static void collector_close(struct peer *peer)
+{
+    if (peer->sensor >= 0)
+        log_message(LOG_INFO, "Sensor %s disconnected", global_sensor_states[peer->sensor].name);
+    watch_remove(peer->fd);
+    close(peer->fd);
+    for (int i = 0; i < global_peer_count; ++i)
+    {
+        if (global_peers[i] == peer)
+            global_peers[i] = global_peers[--global_peer_count];
+    }
+    free(peer);
+}
+
+static bool collector_acknowledge(struct peer *peer, uint64_t sequence)
+{
+    uint8_t payload[10];
+    size_t payload_size = (size_t) (write_varint(payload, sequence) - payload);
+    uint8_t output[16];
+    size_t size = write_frame_header(output, FRAME_ACK, payload_size);
+    memcpy(output + size, payload, payload_size);
+    size += payload_size;
+    // acknowledgements are tiny and cumulative, so there's no need to queue them
+    return send(peer->fd, output, size, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) size;
+}
+
+static bool collector_hello(struct peer *peer, const uint8_t *payload, size_t size)
+{
+    if (size < 8 || peer->sensor >= 0)
+        return false;
+    uint64_t instance = read_le64(payload);
+    char name[sizeof(global_sensor_states[0].name)];
+    size_t length = size - 8 < sizeof(name) - 1 ? size - 8 : sizeof(name) - 1;
+    for (size_t i = 0; i < length; ++i)
+        name[i] = (payload[8 + i] >= 0x20 && payload[8 + i] < 0x7F) ? (char) payload[8 + i] : '?';
+    name[length] = 0;
+
+    int index = 0;
+    while (index < global_sensor_state_count && strcmp(global_sensor_states[index].name, name) != 0)
+        ++index;
+    if (index == global_sensor_state_count)
+    {
+        if (global_sensor_state_count == MAX_SENSORS)
+            return false;
+        ++global_sensor_state_count;
+        strcpy(global_sensor_states[index].name, name);
+    }
+    struct sensor_state *state = &global_sensor_states[index];
+    // a new instance of the sensor starts counting again
+    if (state->instance != instance)
+    {
+        state->instance = instance;
+        state->last_sequence = 0;
+    }
+    peer->sensor = index;
+    log_message(LOG_INFO, "Sensor %s connected", name);
+    return collector_acknowledge(peer, state->last_sequence);
+}
+
+static bool collector_events(struct peer *peer, const uint8_t *payload, size_t size)
+{
+    if (peer->sensor < 0)
+        return false;
+    struct sensor_state *state = &global_sensor_states[peer->sensor];
+    const uint8_t *end = payload + size;
+    uint64_t sequence = 0, count = 0, time = 0;
+    if ((payload = read_varint(payload, end, &sequence)) == NULL ||
+        (payload = read_varint(payload, end, &count)) == NULL ||
+        (payload = read_varint(payload, end, &time)) == NULL || count > SENSOR_BATCH)
+        return false;
+    // frames sent again after a reconnection
+    if (sequence <= state->last_sequence)
+        return collector_acknowledge(peer, state->last_sequence);
+    if (state->last_sequence != 0 && sequence > state->last_sequence + 1)
+        log_message(LOG_WARNING, "Sensor %s lost %" PRIu64 " frames", state->name, sequence - state->last_sequence - 1);
+
+    struct event events[SENSOR_BATCH];
+    int64_t previous = (int64_t) time;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        struct event *event = &events[i];
+        uint64_t delta = 0, port = 0;
+        if ((payload = read_varint(payload, end, &delta)) == NULL ||
+            (payload = read_varint(payload, end, &port)) == NULL || payload >= end || port > 65535)
+            return false;
+        event->time = previous + zigzag_decode(delta);
+        event->port = (int) port;
+        event->sensor = peer->sensor;
+        previous = event->time;
+        memset(&event->source, 0, sizeof(event->source));
+        if (*payload == 4 && end - payload >= 5)
+        {
+            event->source.bytes[10] = event->source.bytes[11] = 0xFF;
+            memcpy(event->source.bytes + 12, payload + 1, 4);
+            payload += 5;
+        }
+        else
+        if (*payload == 6 && end - payload >= 17)
+        {
+            memcpy(event->source.bytes, payload + 1, 16);
+            payload += 17;
+        }
+        else
+            return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        // if there's no room, the oldest event must go out of order
+        if (global_merge_count == COLLECTOR_EVENTS)
+            collector_emit();
+        merge_heap_push(&events[i]);
+    }
+    state->last_sequence = sequence;
+    return collector_acknowledge(peer, sequence);
+}
+
+static void collector_read(int fd, short revents)
+{
+    (void) revents;
+    struct peer *peer = NULL;
+    for (int i = 0; i < global_peer_count && peer == NULL; ++i)
+    {
+        if (global_peers[i]->fd == fd)
+            peer = global_peers[i];
+    }
+    if (peer == NULL)
+        return;
+
+    ssize_t result = recv(fd, peer->input + peer->input_size, sizeof(peer->input) - peer->input_size, 0);
+    if (result <= 0)
+    {
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        collector_close(peer);
+        return;
+    }
+    peer->input_size += (size_t) result;
+
+    size_t offset = 0;
+    for (;;)
+    {
+        enum frame_type type;
+        const uint8_t *payload = NULL;
+        size_t payload_size = 0;
+        int size = read_frame(peer->input + offset, peer->input_size - offset, &type, &payload, &payload_size);
+        if (size == 0)
+            break;
+        bool valid = size > 0;
+        if (valid && type == FRAME_HELLO)
+            valid = collector_hello(peer, payload, payload_size);
+        else
+        if (valid && type == FRAME_EVENTS)
+            valid = collector_events(peer, payload, payload_size);
+        else
+            valid = false;
+        if (!valid)
+        {
+            log_message(LOG_WARNING, "Invalid data from sensor %s", peer->sensor >= 0 ? global_sensor_states[peer->sensor].name : "?");
+            collector_close(peer);
+            return;
+        }
+        offset += (size_t) size;
+    }
+    peer->input_size -= offset;
+    memmove(peer->input, peer->input + offset, peer->input_size);
+}
+
+static void collector_accept(int fd, short revents)
+{
+    (void) revents;
+    int client = accept(fd, NULL, NULL);
+    if (client < 0)
+        return;
+    struct peer *peer = NULL;
+    if (global_peer_count == MAX_PEERS || !set_non_blocking(client) ||
+        (peer = malloc(sizeof(struct peer))) == NULL || !watch_add(client, POLLIN, collector_read))
+    {
+        log_message(LOG_WARNING, "Unable to accept more sensors");
+        free(peer);
+        close(client);
+        return;
+    }
+    peer->fd = client;
+    peer->sensor = -1;
+    peer->input_size = 0;
+    global_peers[global_peer_count++] = peer;
+}
+
+// Option of a listener that couldn't be set, which doesn't keep it from working
+struct server_warning
+{
+    const char *message;    // NULL if every option was set
+    int error;
+};
+
+static int create_server(int port, int family, int max_connections, bool minimal_buffers, struct server_warning *warning);
+static void log_server_warning(const struct server_warning *warning);
+
+static bool collector_start()
+{
+    global_merge_heap = malloc(sizeof(struct event) * COLLECTOR_EVENTS);
+    if (global_merge_heap == NULL)
+        return false;
+    struct server_warning warning;
+    global_collector_fd = create_server(global_collector_port, global_family, MAX_CONNECTIONS, false, &warning);
+    if (global_collector_fd < 0)
+    {
+        log_error("Unable to create collector server", -global_collector_fd);
+        return false;
+    }
+    log_server_warning(&warning);
+    watch_add(global_collector_fd, POLLIN, collector_accept);
+    log_message(LOG_INFO, "Collecting events on the port %d", global_collector_port);
+    return true;
+}
+
+static void collector_stop()
+{
+    while (global_peer_count > 0)
+        collector_close(global_peers[0]);
+    while (global_merge_count > 0)
+        collector_emit();
+    if (global_collector_fd >= 0)
+        close(global_collector_fd);
+    free(global_merge_heap);
+}
+
+static void mask_address(const struct source_address *address, int length, struct source_address *output)
+{
+    for (int i = 0; i < 16; ++i)
+    {
+        int bits = length - i * 8;
+        output->bytes[i] = bits >= 8 ? address->bytes[i] : (bits <= 0 ? 0 : (uint8_t) (address->bytes[i] & (0xFF << (8 - bits))));
+    }
+}
+
+static uint64_t ban_hash(const struct source_address *prefix, int length)
+{
+    uint8_t key[17];
+    memcpy(key, prefix->bytes, 16);
+    key[16] = (uint8_t) length;
+    return siphash(key, sizeof(key), global_hash_key);
+}
+
+static void ban_set_count_length(int length, int delta)
+{
+    global_ban_length_count[length] += delta;
+    if (global_ban_length_count[length] != 0 && global_ban_length_count[length] != delta)
+        return;
+    // the list of lengths in use only changes when a length appears or disappears
+    global_ban_length_total = 0;
+    for (int i = 128; i >= 0; --i)
+    {
+        if (global_ban_length_count[i] > 0)
+            global_ban_lengths[global_ban_length_total++] = i;
+    }
+}
+
+// Ban the prefix until 'expires'; return false if the prefix was already banned for that long
+static bool ban_set_add(const struct source_address *address, int length, int64_t expires, int64_t now)
+{
+    if (global_bans == NULL && (global_bans = calloc(BAN_SLOTS, sizeof(struct ban_entry))) == NULL)
+        return false;
+    struct source_address prefix;
+    mask_address(address, length, &prefix);
+
+    uint64_t hash = ban_hash(&prefix, length);
+    struct ban_entry *victim = NULL;
+    for (uint64_t i = 0; i < BAN_PROBES; ++i)
+    {
+        struct ban_entry *entry = &global_bans[(hash + i) & (BAN_SLOTS - 1)];
+        if (entry->expires > 0 && entry->length == length && memcmp(&entry->prefix, &prefix, sizeof(prefix)) == 0)
+        {
+            if (entry->expires >= expires)
+                return false;
+            entry->expires = expires;
+            return true;
+        }
+        // prefer empty or expired slots, then the ban closer to expire
+        if (victim == NULL || (victim->expires > now && entry->expires < victim->expires))
+            victim = entry;
+    }
+
+    if (victim->expires > 0)
+        ban_set_count_length(victim->length, -1);
+    victim->prefix = prefix;
+    victim->length = length;
+    victim->expires = expires;
+    ban_set_count_length(length, 1);
+    return true;
+}
+
+static bool ban_set_contains(const struct source_address *address, int64_t now)
+{
+    for (int l = 0; l < global_ban_length_total; ++l)
+    {
+        int length = global_ban_lengths[l];
+        struct source_address prefix;
+        mask_address(address, length, &prefix);
+        uint64_t hash = ban_hash(&prefix, length);
+        for (uint64_t i = 0; i < BAN_PROBES; ++i)
+        {
+            const struct ban_entry *entry = &global_bans[(hash + i) & (BAN_SLOTS - 1)];
+            if (entry->expires > now && entry->length == length && memcmp(&entry->prefix, &prefix, sizeof(prefix)) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+static const char *format_prefix(const struct source_address *prefix, int length, char *output, size_t size)
+{
+    char address[INET6_ADDRSTRLEN];
+    format_source(prefix, address, sizeof(address));
+    if (length == 128)
+        snprintf(output, size, "%s", address);
+    else
+        snprintf(output, size, "%s/%d", address, source_is_ipv4(prefix) && length >= 96 ? length - 96 : length);
+    return output;
+}
+
+static void gossip_bloom_position(const struct source_address *prefix, int length, int index, uint64_t *word, uint64_t *bit)
+{
+    uint64_t hash = ban_hash(prefix, length);
+    uint64_t position = ((hash & 0xFFFFFFFF) + (uint64_t) index * (hash >> 32)) % GOSSIP_BLOOM;
+    *word = position / 64;
+    *bit = (uint64_t) 1 << (position % 64);
+}
+
+// Return whether the prefix was seen recently and remember it
+static bool gossip_seen(const struct source_address *prefix, int length)
+{
+    struct gossip *gossip = global_gossip;
+    bool seen[2] = {true, true};
+    for (int i = 0; i < 4; ++i)
+    {
+        uint64_t word, bit;
+        gossip_bloom_position(prefix, length, i, &word, &bit);
+        for (int g = 0; g < 2; ++g)
+            seen[g] = seen[g] && (gossip->bloom[g][word] & bit) != 0;
+        gossip->bloom[0][word] |= bit;
+    }
+    return seen[0] || seen[1];
+}
+
+static void gossip_flush()
+{
+    struct gossip *gossip = global_gossip;
+    if (gossip->batch_size <= 20)
+        return;
+    write_le64(gossip->batch + gossip->batch_size, siphash(gossip->batch, gossip->batch_size, gossip->key));
+    gossip->batch_size += 8;
+    for (int i = 0; i < gossip->peer_count; ++i)
+    {
+        if (sendto(gossip->fd, gossip->batch, gossip->batch_size, 0, (const struct sockaddr *) &gossip->peers[i], gossip->peer_sizes[i]) < 0)
+            log_error("Unable to send bans to peers", errno);
+    }
+    gossip->batch_size = 0;
+}
+
+static void gossip_announce(const struct source_address *prefix, int length, int64_t duration, int64_t now)
+{
+    struct gossip *gossip = global_gossip;
+    if (gossip_seen(prefix, length))
+        return;
+    if (gossip->batch_size + 32 + 8 > sizeof(gossip->batch))
+        gossip_flush();
+    if (gossip->batch_size == 0)
+    {
+        memcpy(gossip->batch, "NBG\1", 4);
+        write_le64(gossip->batch + 4, gossip->id);
+        write_le64(gossip->batch + 12, (uint64_t) now);
+        gossip->batch_size = 20;
+        gossip->batch_deadline = now + GOSSIP_DELAY;
+    }
+
+    // IPv4 prefixes are sent without the IPv4-mapped part
+    uint8_t *output = gossip->batch + gossip->batch_size;
+    const uint8_t *bytes = prefix->bytes;
+    if (source_is_ipv4(prefix) && length >= 96)
+    {
+        length -= 96;
+        bytes += 12;
+        *output++ = (uint8_t) (0x80 | length);
+    }
+    else
+        *output++ = (uint8_t) length;
+    memcpy(output, bytes, (size_t) (length + 7) / 8);
+    output += (length + 7) / 8;
+    output = write_varint(output, (uint64_t) (duration / 1000));
+    gossip->batch_size = (size_t) (output - gossip->batch);
+}
+
+static void gossip_receive(int fd, short revents)
+{
+    (void) revents;
+    struct gossip *gossip = global_gossip;
+    uint8_t data[GOSSIP_DATAGRAM + 1];
+    ssize_t result = recv(fd, data, sizeof(data), 0);
+    if (result < 20 + 8 || result > GOSSIP_DATAGRAM || memcmp(data, "NBG\1", 4) != 0)
+        return;
+    size_t size = (size_t) result - 8;
+
+    // constant time comparison of the tag
+    uint8_t tag[8];
+    write_le64(tag, siphash(data, size, gossip->key));
+    uint8_t difference = 0;
+    for (int i = 0; i < 8; ++i)
+        difference |= (uint8_t) (tag[i] ^ data[size + (size_t) i]);
+    int64_t now = current_time_ms();
+    int64_t time = (int64_t) read_le64(data + 12);
+    if (difference != 0 || read_le64(data + 4) == gossip->id || time < now - GOSSIP_MAX_AGE || time > now + GOSSIP_MAX_AGE)
+        return;
+
+    const uint8_t *input = data + 20;
+    const uint8_t *end = data + size;
+    while (input < end)
+    {
+        struct source_address prefix;
+        memset(&prefix, 0, sizeof(prefix));
+        int length = *input & 0x7F;
+        bool ipv4 = (*input++ & 0x80) != 0;
+        size_t bytes = (size_t) (length + 7) / 8;
+        uint64_t duration = 0;
+        if ((ipv4 && length > 32) || length > 128 || (size_t) (end - input) < bytes)
+            return;
+        if (ipv4)
+        {
+            prefix.bytes[10] = prefix.bytes[11] = 0xFF;
+            memcpy(prefix.bytes + 12, input, bytes);
+            length += 96;
+        }
+        else
+            memcpy(prefix.bytes, input, bytes);
+        input += bytes;
+        if ((input = read_varint(input, end, &duration)) == NULL || duration > 365 * 86400)
+            return;
+        mask_address(&prefix, length, &prefix);
+
+        if (gossip_seen(&prefix, length) || !ban_set_add(&prefix, length, now + (int64_t) duration * 1000, now))
+            continue;
+        char text[INET6_ADDRSTRLEN + 8];
+        log_message(LOG_INFO, "BAN %s (gossip)", format_prefix(&prefix, length, text, sizeof(text)));
+    }
+}
+
+static bool gossip_load_key(const char *path, uint8_t key[16])
+{
+    FILE *input = fopen(path, "rb");
+    if (input == NULL)
+        return false;
+    char secret[256];
+    size_t size = fread(secret, 1, sizeof(secret), input);
+    fclose(input);
+    while (size > 0 && (secret[size - 1] == '\n' || secret[size - 1] == '\r' || secret[size - 1] == ' '))
+        --size;
+    if (size == 0)
+        return false;
+
+    // derive the key from the secret shared by every instance
+    uint8_t seed[16];
+    memset(seed, 0, sizeof(seed));
+    write_le64(key, siphash(secret, size, seed));
+    seed[0] = 1;
+    write_le64(key + 8, siphash(secret, size, seed));
+    return true;
+}
+
+static bool gossip_join(int fd, const struct sockaddr_storage *address)
+{
+    if (address->ss_family == AF_INET)
+    {
+        const struct sockaddr_in *group = (const struct sockaddr_in *) address;
+        if (!IN_MULTICAST(ntohl(group->sin_addr.s_addr)))
+            return true;
+        struct ip_mreq request;
+        memset(&request, 0, sizeof(request));
+        request.imr_multiaddr = group->sin_addr;
+        request.imr_interface.s_addr = htonl(INADDR_ANY);
+        return setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) == 0;
+    }
+    const struct sockaddr_in6 *group = (const struct sockaddr_in6 *) address;
+    if (!IN6_IS_ADDR_MULTICAST(&group->sin6_addr))
+        return true;
+    struct ipv6_mreq request;
+    memset(&request, 0, sizeof(request));
+    request.ipv6mr_multiaddr = group->sin6_addr;
+    return setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request)) == 0;
+}
+
+static bool gossip_start()
+{
+    struct gossip *gossip = calloc(1, sizeof(struct gossip));
+    if (gossip == NULL)
+        return false;
+    global_gossip = gossip;
+    gossip->fd = -1;
+    if (global_gossip_key_file == NULL || !gossip_load_key(global_gossip_key_file, gossip->key))
+    {
+        log_message(LOG_ERROR, "Unable to load the gossip key from '%s'", global_gossip_key_file ? global_gossip_key_file : "");
+        return false;
+    }
+    for (int i = 0; i < global_gossip_target_count; ++i)
+    {
+        if (!parse_endpoint(global_gossip_targets[i], &gossip->peers[i], &gossip->peer_sizes[i]) ||
+            gossip->peers[i].ss_family != gossip->peers[0].ss_family)
+        {
+            log_message(LOG_ERROR, "Invalid gossip address '%s'", global_gossip_targets[i]);
+            return false;
+        }
+        ++gossip->peer_count;
+    }
+    random_bytes(&gossip->id, sizeof(gossip->id));
+
+    // bind to the port of the first address, unless another one was given
+    int family = gossip->peers[0].ss_family;
+    struct sockaddr_storage local;
+    memset(&local, 0, sizeof(local));
+    local.ss_family = (sa_family_t) family;
+    uint16_t port = global_gossip_port ? htons((uint16_t) global_gossip_port) :
+        (family == AF_INET ? ((struct sockaddr_in *) &gossip->peers[0])->sin_port : ((struct sockaddr_in6 *) &gossip->peers[0])->sin6_port);
+    if (family == AF_INET)
+        ((struct sockaddr_in *) &local)->sin_port = port;
+    else
+        ((struct sockaddr_in6 *) &local)->sin6_port = port;
+
+    int value = 1;
+    gossip->fd = socket(family, SOCK_DGRAM, 0);
+    if (gossip->fd < 0 || setsockopt(gossip->fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0 ||
+        bind(gossip->fd, (const struct sockaddr *) &local, family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) < 0 ||
+        !set_non_blocking(gossip->fd))
+    {
+        log_error("Unable to create the gossip socket", errno);
+        return false;
+    }
+    for (int i = 0; i < gossip->peer_count; ++i)
+    {
+        if (!gossip_join(gossip->fd, &gossip->peers[i]))
+            log_error("Unable to join the multicast group", errno);
+    }
+    watch_add(gossip->fd, POLLIN, gossip_receive);
+    gossip->rotate_at = current_time_ms() + GOSSIP_ROTATION;
+    log_message(LOG_INFO, "Exchanging bans with %d addresses on the port %d", gossip->peer_count, ntohs(port));
+    return true;
+}
+
+static void gossip_stop()
+{
+    if (global_gossip == NULL)
+        return;
+    if (global_gossip->fd >= 0)
+    {
+        gossip_flush();
+        close(global_gossip->fd);
+    }
+    free(global_gossip);
+    global_gossip = NULL;
+}
+
+// Ban a source locally and tell the other instances
+static void ban_source(const struct source_address *source, int64_t duration, int64_t now)
+{
+    if (ban_set_add(source, 128, now + duration, now) && global_gossip != NULL)
+        gossip_announce(source, 128, duration, now);
+}
+
+static int compare_prefixes(const void *a, const void *b)
+{
+    const struct ban_entry *x = a;
+    const struct ban_entry *y = b;
+    int order = memcmp(&x->prefix, &y->prefix, sizeof(x->prefix));
+    return order != 0 ? order : x->length - y->length;
+}
+
+// Reduce sorted prefixes to the smallest list covering the same addresses and return its size
+static int collapse_prefixes(struct ban_entry *prefixes, int count, int minimum_length)
+{
+    int top = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        struct source_address masked;
+        if (top > 0 && prefixes[i].length >= prefixes[top - 1].length)
+        {
+            // covered by the previous prefix
+            mask_address(&prefixes[i].prefix, prefixes[top - 1].length, &masked);
+            if (memcmp(&masked, &prefixes[top - 1].prefix, sizeof(masked)) == 0)
+                continue;
+        }
+        prefixes[top++] = prefixes[i];
+
+        // the two halves of a prefix are replaced by the prefix, which may complete a larger one
+        while (top > 1 && prefixes[top - 1].length == prefixes[top - 2].length && prefixes[top - 1].length > minimum_length)
+        {
+            int length = prefixes[top - 1].length - 1;
+            mask_address(&prefixes[top - 1].prefix, length, &masked);
+            if (memcmp(&masked, &prefixes[top - 2].prefix, sizeof(masked)) != 0)
+                break;
+            --top;
+            prefixes[top - 1].length = length;
+        }
+    }
+    return top;
+}
+
+static void firewall_write_nft(FILE *file, const struct ban_entry *prefixes, const int *counts)
+{
+    // declaring the table and the sets again is harmless, and the whole file is applied as one transaction
+    fputs("table inet " FIREWALL_TABLE " {\n"
+        "    set banned4 { type ipv4_addr; flags interval; }\n"
+        "    set banned6 { type ipv6_addr; flags interval; }\n"
+        "}\n", file);
+    for (int family = 0; family < 2; ++family)
+    {
+        const char *set = family == 0 ? "banned4" : "banned6";
+        fprintf(file, "flush set inet " FIREWALL_TABLE " %s\n", set);
+        for (int i = 0; i < counts[family]; ++i)
+        {
+            char text[INET6_ADDRSTRLEN + 4];
+            format_prefix(&prefixes[i].prefix, prefixes[i].length, text, sizeof(text));
+            if (i == 0)
+                fprintf(file, "add element inet " FIREWALL_TABLE " %s {\n    %s", set, text);
+            else
+                fprintf(file, ",\n    %s", text);
+        }
+        if (counts[family] > 0)
+            fputs("\n}\n", file);
+        prefixes += counts[family];
+    }
+}
+
+static void firewall_write_ipset(FILE *file, const struct ban_entry *prefixes, const int *counts)
+{
+    // the sets are filled under a temporary name and swapped, so they are never seen empty
+    for (int family = 0; family < 2; ++family)
+    {
+        const char *set = family == 0 ? FIREWALL_TABLE "4" : FIREWALL_TABLE "6";
+        const char *type = family == 0 ? "inet" : "inet6";
+        fprintf(file, "create %s hash:net family %s maxelem %d -exist\n", set, type, BAN_SLOTS);
+        fprintf(file, "create %s_new hash:net family %s maxelem %d -exist\n", set, type, BAN_SLOTS);
+        fprintf(file, "flush %s_new\n", set);
+        for (int i = 0; i < counts[family]; ++i)
+        {
+            char text[INET6_ADDRSTRLEN + 4];
+            fprintf(file, "add %s_new %s\n", set, format_prefix(&prefixes[i].prefix, prefixes[i].length, text, sizeof(text)));
+        }
+        fprintf(file, "swap %s_new %s\ndestroy %s_new\n", set, set, set);
+        prefixes += counts[family];
+    }
+}
+
+// Write the active bans, collapsed to a minimal list of prefixes, as a firewall restore file if they changed
+static void firewall_export(int64_t now)
+{
+    global_firewall_deadline = now + global_firewall_interval * 1000;
+    struct ban_entry *prefixes = malloc(BAN_SLOTS * sizeof(struct ban_entry));
+    if (prefixes == NULL)
+        return;
+
+    // the IPv4 prefixes first, then the IPv6 ones
+    int counts[2] = {0, 0};
+    int total = 0;
+    for (int family = 0; family < 2 && global_bans != NULL; ++family)
+    {
+        for (int i = 0; i < BAN_SLOTS; ++i)
+        {
+            const struct ban_entry *entry = &global_bans[i];
+            if (entry->expires <= now || (source_is_ipv4(&entry->prefix) && entry->length >= 96) != (family == 0))
+                continue;
+            prefixes[total].prefix = entry->prefix;
+            prefixes[total].length = entry->length;
+            prefixes[total].expires = 0;
+            ++total;
+            ++counts[family];
+        }
+        struct ban_entry *start = prefixes + total - counts[family];
+        qsort(start, (size_t) counts[family], sizeof(struct ban_entry), compare_prefixes);
+        counts[family] = collapse_prefixes(start, counts[family], family == 0 ? 96 : 0);
+        total = (int) (start - prefixes) + counts[family];
+    }
+
+    uint64_t digest = (uint64_t) counts[0] << 32 | (uint64_t) counts[1];
+    for (int i = 0; i < total; ++i)
+        digest = digest * 0x100000001B3 ^ ban_hash(&prefixes[i].prefix, prefixes[i].length);
+    if (global_firewall_written && digest == global_firewall_digest)
+    {
+        free(prefixes);
+        return;
+    }
+
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", global_firewall_file);
+    FILE *file = fopen(temporary, "w");
+    bool result = file != NULL;
+    if (result && global_firewall_format == FIREWALL_NFT)
+        firewall_write_nft(file, prefixes, counts);
+    else if (result)
+        firewall_write_ipset(file, prefixes, counts);
+    if (file != NULL && (ferror(file) || fclose(file) != 0))
+        result = false;
+    free(prefixes);
+    if (!result || rename(temporary, global_firewall_file) != 0)
+    {
+        log_message(LOG_ERROR, "Unable to write the firewall file '%s'", global_firewall_file);
+        return;
+    }
+    global_firewall_digest = digest;
+    global_firewall_written = true;
+    log_message(LOG_DEBUG, "Wrote %d IPv4 and %d IPv6 prefixes to '%s'", counts[0], counts[1], global_firewall_file);
+}
+
+// The key is fixed so the sketches of every instance can be merged
+static const uint8_t SKETCH_KEY[16] = {'n', 'e', 't', '-', 'b', 'o', 'u', 'n', 'c', 'e', 'r', '-', 'h', 'l', 'l', '1'};
+
+static void sketch_add(struct sketch *sketch, const struct source_address *source)
+{
+    uint64_t hash = siphash(source, sizeof(*source), SKETCH_KEY);
+    ++sketch->total;
+
+    // HyperLogLog
+    uint64_t index = hash >> (64 - SKETCH_PRECISION);
+    uint8_t rank = (uint8_t) (__builtin_clzll((hash << SKETCH_PRECISION) | ((uint64_t) 1 << (SKETCH_PRECISION - 1))) + 1);
+    if (rank > sketch->registers[index])
+        sketch->registers[index] = rank;
+
+    // Space-Saving
+    for (int i = 0; i < sketch->top_count; ++i)
+    {
+        if (sketch->hashes[i] == hash && memcmp(&sketch->top[i].source, source, sizeof(*source)) == 0)
+        {
+            ++sketch->top[i].count;
+            return;
+        }
+    }
+    int slot = sketch->top_count;
+    uint64_t minimum = 0;
+    if (sketch->top_count < SKETCH_TOP)
+        ++sketch->top_count;
+    else
+    {
+        slot = 0;
+        for (int i = 1; i < SKETCH_TOP; ++i)
+        {
+            if (sketch->top[i].count < sketch->top[slot].count)
+                slot = i;
+        }
+        minimum = sketch->top[slot].count;
+    }
+    sketch->hashes[slot] = hash;
+    sketch->top[slot].source = *source;
+    sketch->top[slot].count = minimum + 1;
+    sketch->top[slot].error = minimum;
+}
+
+static double sketch_unique(const struct sketch *sketch)
+{
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < SKETCH_REGISTERS; ++i)
+    {
+        sum += 1.0 / (double) ((uint64_t) 1 << sketch->registers[i]);
+        zeros += sketch->registers[i] == 0;
+    }
+    double m = SKETCH_REGISTERS;
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // linear counting is more accurate for small cardinalities
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log(m / zeros);
+    return estimate;
+}
+
+static uint64_t sketch_top_minimum(const struct sketch *sketch)
+{
+    if (sketch->top_count < SKETCH_TOP)
+        return 0;
+    uint64_t minimum = UINT64_MAX;
+    for (int i = 0; i < sketch->top_count; ++i)
+    {
+        if (sketch->top[i].count < minimum)
+            minimum = sketch->top[i].count;
+    }
+    return minimum;
+}
+
+static int compare_top_entries(const void *a, const void *b)
+{
+    uint64_t x = ((const struct top_entry *) a)->count;
+    uint64_t y = ((const struct top_entry *) b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void sketch_merge(struct sketch *target, const struct sketch *source)
+{
+    target->total += source->total;
+    for (int i = 0; i < SKETCH_REGISTERS; ++i)
+    {
+        if (source->registers[i] > target->registers[i])
+            target->registers[i] = source->registers[i];
+    }
+
+    // a source missing from a full list may have up to its minimum count
+    uint64_t target_minimum = sketch_top_minimum(target);
+    uint64_t source_minimum = sketch_top_minimum(source);
+    struct top_entry entries[SKETCH_TOP * 2];
+    int count = 0;
+    bool merged[SKETCH_TOP] = {false};
+    for (int i = 0; i < target->top_count; ++i)
+    {
+        entries[count] = target->top[i];
+        entries[count].count += source_minimum;
+        entries[count].error += source_minimum;
+        for (int j = 0; j < source->top_count; ++j)
+        {
+            if (memcmp(&source->top[j].source, &target->top[i].source, sizeof(struct source_address)) == 0)
+            {
+                entries[count].count = target->top[i].count + source->top[j].count;
+                entries[count].error = target->top[i].error + source->top[j].error;
+                merged[j] = true;
+                break;
+            }
+        }
+        ++count;
+    }
+    for (int j = 0; j < source->top_count; ++j)
+    {
+        if (merged[j])
+            continue;
+        entries[count] = source->top[j];
+        entries[count].count += target_minimum;
+        entries[count].error += target_minimum;
+        ++count;
+    }
+
+    qsort(entries, (size_t) count, sizeof(struct top_entry), compare_top_entries);
+    target->top_count = count < SKETCH_TOP ? count : SKETCH_TOP;
+    for (int i = 0; i < target->top_count; ++i)
+    {
+        target->top[i] = entries[i];
+        target->hashes[i] = siphash(&entries[i].source, sizeof(struct source_address), SKETCH_KEY);
+    }
+}
+
+static struct sketch *sketch_set_find(struct sketch_set *set, int port, bool create)
+{
+    for (int i = 0; i < set->count; ++i)
+    {
+        if (set->sketches[i].port == port)
+            return &set->sketches[i];
+    }
+    if (!create)
+        return NULL;
+    struct sketch *sketches = realloc(set->sketches, sizeof(struct sketch) * (size_t) (set->count + 1));
+    if (sketches == NULL)
+        return NULL;
+    set->sketches = sketches;
+    memset(&sketches[set->count], 0, sizeof(struct sketch));
+    sketches[set->count].port = port;
+    return &sketches[set->count++];
+}
+
+/*
+ * Sketch file format (integers are little-endian or varints):
+ *
+ *   "NBSK", version, precision, top size, reserved
+ *   interval start and end (milliseconds, 8 bytes each)
+ *   port count
+ *   for each port:
+ *     port, total connections
+ *     register encoding (0 = dense, 1 = sparse)
+ *       dense: all registers
+ *       sparse: count of non-zero registers, then (index delta, value) pairs
+ *     top count, then (family, address, count, error) for each entry
+ */
+static bool sketch_set_write(const struct sketch_set *set, const char *path)
+{
+    size_t capacity = 32 + (size_t) set->count * (SKETCH_REGISTERS + SKETCH_TOP * 40 + 32);
+    uint8_t *data = malloc(capacity);
+    if (data == NULL)
+        return false;
+    uint8_t *output = data;
+    memcpy(output, "NBSK", 4);
+    output[4] = 1;
+    output[5] = SKETCH_PRECISION;
+    output[6] = SKETCH_TOP;
+    output[7] = 0;
+    write_le64(output + 8, (uint64_t) set->start);
+    write_le64(output + 16, (uint64_t) set->end);
+    output = write_varint(output + 24, (uint64_t) set->count);
+
+    for (int s = 0; s < set->count; ++s)
+    {
+        const struct sketch *sketch = &set->sketches[s];
+        output = write_varint(output, (uint64_t) sketch->port);
+        output = write_varint(output, sketch->total);
+        int used = 0;
+        for (int i = 0; i < SKETCH_REGISTERS; ++i)
+            used += sketch->registers[i] != 0;
+        if (used * 3 < SKETCH_REGISTERS)
+        {
+            *output++ = 1;
+            output = write_varint(output, (uint64_t) used);
+            for (int i = 0, last = 0; i < SKETCH_REGISTERS; ++i)
+            {
+                if (sketch->registers[i] == 0)
+                    continue;
+                output = write_varint(output, (uint64_t) (i - last));
+                *output++ = sketch->registers[i];
+                last = i;
+            }
+        }
+        else
+        {
+            *output++ = 0;
+            memcpy(output, sketch->registers, SKETCH_REGISTERS);
+            output += SKETCH_REGISTERS;
+        }
+
+        output = write_varint(output, (uint64_t) sketch->top_count);
+        for (int i = 0; i < sketch->top_count; ++i)
+        {
+            const struct top_entry *entry = &sketch->top[i];
+            bool ipv4 = source_is_ipv4(&entry->source);
+            *output++ = ipv4 ? 4 : 6;
+            memcpy(output, entry->source.bytes + (ipv4 ? 12 : 0), ipv4 ? 4 : 16);
+            output += ipv4 ? 4 : 16;
+            output = write_varint(output, entry->count);
+            output = write_varint(output, entry->error);
+        }
+    }
+
+    // write the file atomically
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "wb");
+    bool result = file != NULL && fwrite(data, 1, (size_t) (output - data), file) == (size_t) (output - data);
+    if (file != NULL && fclose(file) != 0)
+        result = false;
+    free(data);
+    return result && rename(temporary, path) == 0;
+}
+
+// Parse one sketch; return the input position after it or NULL if the data is invalid
+static const uint8_t *sketch_parse(const uint8_t *input, const uint8_t *limit, struct sketch *sketch)
+{
+    uint64_t port = 0, value = 0;
+    memset(sketch, 0, sizeof(*sketch));
+    if ((input = read_varint(input, limit, &port)) == NULL || port > 65535 ||
+        (input = read_varint(input, limit, &sketch->total)) == NULL || input >= limit)
+        return NULL;
+    sketch->port = (int) port;
+
+    if (*input++ == 1)
+    {
+        if ((input = read_varint(input, limit, &value)) == NULL)
+            return NULL;
+        uint64_t index = 0;
+        for (uint64_t i = 0; i < value; ++i)
+        {
+            uint64_t delta = 0;
+            if ((input = read_varint(input, limit, &delta)) == NULL || input >= limit || (index += delta) >= SKETCH_REGISTERS)
+                return NULL;
+            sketch->registers[index] = *input++;
+        }
+    }
+    else
+    {
+        if (limit - input < SKETCH_REGISTERS)
+            return NULL;
+        memcpy(sketch->registers, input, SKETCH_REGISTERS);
+        input += SKETCH_REGISTERS;
+    }
+
+    if ((input = read_varint(input, limit, &value)) == NULL || value > SKETCH_TOP)
+        return NULL;
+    for (uint64_t i = 0; i < value; ++i)
+    {
+        struct top_entry *entry = &sketch->top[sketch->top_count++];
+        size_t length = input < limit && *input == 4 ? 4 : 16;
+        if (input >= limit || (size_t) (limit - input) < length + 1)
+            return NULL;
+        if (length == 4)
+            entry->source.bytes[10] = entry->source.bytes[11] = 0xFF;
+        memcpy(entry->source.bytes + 16 - length, input + 1, length);
+        input += length + 1;
+        if ((input = read_varint(input, limit, &entry->count)) == NULL || (input = read_varint(input, limit, &entry->error)) == NULL)
+            return NULL;
+    }
+    return input;
+}
+
+// Merge the sketches in the file into the set
+static bool sketch_set_read(struct sketch_set *set, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    uint8_t *data = NULL;
+    long size = 0;
+    bool result = fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 25 && fseek(file, 0, SEEK_SET) == 0 &&
+        (data = malloc((size_t) size)) != NULL && fread(data, 1, (size_t) size, file) == (size_t) size;
+    fclose(file);
+    if (!result || memcmp(data, "NBSK\1", 5) != 0 || data[5] != SKETCH_PRECISION || data[6] != SKETCH_TOP)
+    {
+        free(data);
+        return false;
+    }
+
+    int64_t start = (int64_t) read_le64(data + 8);
+    int64_t end = (int64_t) read_le64(data + 16);
+    if (set->end == 0 || start < set->start)
+        set->start = start;
+    if (end > set->end)
+        set->end = end;
+
+    const uint8_t *input = data + 24;
+    const uint8_t *limit = data + size;
+    uint64_t count = 0;
+    struct sketch *sketch = malloc(sizeof(struct sketch));
+    input = sketch != NULL ? read_varint(input, limit, &count) : NULL;
+    for (uint64_t i = 0; input != NULL && i < count; ++i)
+    {
+        struct sketch *target = NULL;
+        if ((input = sketch_parse(input, limit, sketch)) != NULL && (target = sketch_set_find(set, sketch->port, true)) != NULL)
+            sketch_merge(target, sketch);
+        else
+            input = NULL;
+    }
+    free(sketch);
+    free(data);
+    return input == limit;
+}
+
+static void sketch_export(int64_t now)
+{
+    global_sketches.end = now;
+    char path[4096];
+    time_t t = global_sketches.start / 1000;
+    struct tm tm;
+    if (strftime(path, sizeof(path), global_sketch_file, localtime_r(&t, &tm)) == 0 ||
+        !sketch_set_write(&global_sketches, path))
+        log_message(LOG_ERROR, "Unable to write the sketches to '%s'", global_sketch_file);
+
+    // each file covers one interval
+    for (int i = 0; i < global_sketches.count; ++i)
+    {
+        int port = global_sketches.sketches[i].port;
+        memset(&global_sketches.sketches[i], 0, sizeof(struct sketch));
+        global_sketches.sketches[i].port = port;
+    }
+    global_sketches.start = now;
+    global_sketch_deadline = now + global_sketch_interval * 1000;
+}
+
+static bool sketch_start()
+{
+    for (int p = 0; p < global_port_count; ++p)
+    {
+        if (sketch_set_find(&global_sketches, global_ports[p], true) == NULL)
+            return false;
+    }
+    global_sketches.start = current_time_ms();
+    global_sketch_deadline = global_sketches.start + global_sketch_interval * 1000;
+    return true;
+}
+
+static void sketch_stop()
+{
+    if (global_sketch_file != NULL && global_sketches.sketches != NULL)
+        sketch_export(current_time_ms());
+    free(global_sketches.sketches);
+}
+
+// Merge the sketch files and write the result to a file or to 'stdout' as text
+static int merge_sketches(int count, char * const *files)
+{
+    struct sketch_set set = {0};
+    for (int i = 0; i < count; ++i)
+    {
+        if (!sketch_set_read(&set, files[i]))
+        {
+            fprintf(stderr, "Unable to read sketches from '%s'\n", files[i]);
+            free(set.sketches);
+            return 1;
+        }
+    }
+
+    int result = 0;
+    if (global_merge_output != NULL && !sketch_set_write(&set, global_merge_output))
+    {
+        fprintf(stderr, "Unable to write sketches to '%s'\n", global_merge_output);
+        result = 1;
+    }
+    if (global_show_sketches)
+    {
+        char start[32], end[32];
+        time_t t = set.start / 1000;
+        struct tm tm;
+        strftime(start, sizeof(start), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+        t = set.end / 1000;
+        strftime(end, sizeof(end), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+        printf("Interval from %s to %s\n", start, end);
+        for (int s = 0; s < set.count; ++s)
+        {
+            struct sketch *sketch = &set.sketches[s];
+            printf("Port %d: %" PRIu64 " connections from about %.0f sources\n", sketch->port, sketch->total, sketch_unique(sketch));
+            qsort(sketch->top, (size_t) sketch->top_count, sizeof(struct top_entry), compare_top_entries);
+            for (int i = 0; i < sketch->top_count; ++i)
+            {
+                char address[INET6_ADDRSTRLEN];
+                printf("    %-40s %" PRIu64 " (error %" PRIu64 ")\n",
+                    format_source(&sketch->top[i].source, address, sizeof(address)), sketch->top[i].count, sketch->top[i].error);
+            }
+        }
+    }
+    free(set.sketches);
+    return result;
+}
+
+static void buffer_append(struct buffer *buffer, const void *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->size + size)
+            capacity *= 2;
+        uint8_t *memory = realloc(buffer->data, capacity);
+        if (memory == NULL)
+        {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = memory;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void buffer_varint(struct buffer *buffer, uint64_t value)
+{
+    uint8_t data[10];
+    buffer_append(buffer, data, (size_t) (write_varint(data, value) - data));
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+    static uint32_t table[256];
+    if (table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit)
+                value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+            table[i] = value;
+        }
+    }
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+static void archive_write(struct archive_writer *writer, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, writer->file) != size)
+        writer->columns[0].failed = true;
+    writer->offset += size;
+}
+
+// Write a length-prefixed section followed by its checksum
+static void archive_write_section(struct archive_writer *writer, const struct buffer *buffer)
+{
+    uint8_t header[10];
+    archive_write(writer, header, (size_t) (write_varint(header, buffer->size) - header));
+    archive_write(writer, buffer->data, buffer->size);
+    uint8_t checksum[4];
+    uint32_t crc = crc32(buffer->data, buffer->size);
+    for (int i = 0; i < 4; ++i, crc >>= 8)
+        checksum[i] = (uint8_t) crc;
+    archive_write(writer, checksum, sizeof(checksum));
+}
+
+static void archive_flush_block(struct archive_writer *writer)
+{
+    if (writer->lines == 0)
+        return;
+
+    // run-length encoding of kinds
+    for (int i = 0; i < writer->lines;)
+    {
+        int run = 1;
+        while (i + run < writer->lines && writer->kinds[i + run] == writer->kinds[i])
+            ++run;
+        buffer_varint(&writer->columns[COLUMN_KIND], (uint64_t) run);
+        buffer_append(&writer->columns[COLUMN_KIND], &writer->kinds[i], 1);
+        i += run;
+    }
+
+    // dictionary of ports
+    int dictionary[ARCHIVE_BLOCK];
+    int count = 0;
+    struct buffer references = {0};
+    for (int i = 0; i < writer->lines; ++i)
+    {
+        if (writer->ports[i] < 0)
+            continue;
+        int index = 0;
+        while (index < count && dictionary[index] != writer->ports[i])
+            ++index;
+        if (index == count)
+            dictionary[count++] = writer->ports[i];
+        buffer_varint(&references, (uint64_t) index);
+    }
+    buffer_varint(&writer->columns[COLUMN_PORT], (uint64_t) count);
+    for (int i = 0; i < count; ++i)
+        buffer_varint(&writer->columns[COLUMN_PORT], (uint64_t) dictionary[i]);
+    buffer_append(&writer->columns[COLUMN_PORT], references.data, references.size);
+    free(references.data);
+
+    // index entry: offset, line count and time range
+    buffer_varint(&writer->index, writer->offset);
+    buffer_varint(&writer->index, (uint64_t) writer->lines);
+    buffer_varint(&writer->index, zigzag_encode(writer->first_time));
+    buffer_varint(&writer->index, zigzag_encode(writer->last_time));
+    ++writer->block_count;
+
+    uint8_t header[10];
+    archive_write(writer, header, (size_t) (write_varint(header, (uint64_t) writer->lines) - header));
+    for (int c = 0; c < COLUMN_COUNT; ++c)
+    {
+        if (writer->columns[c].failed)
+            writer->columns[0].failed = true;
+        archive_write_section(writer, &writer->columns[c]);
+        writer->columns[c].size = 0;
+    }
+    writer->lines = 0;
+    writer->previous_time = writer->previous_delta = 0;
+    writer->first_time = writer->last_time;
+}
+
+static uint32_t archive_address(struct archive_writer *writer, const struct source_address *address)
+{
+    // keep the table at most half full
+    if (writer->address_count * 2 >= writer->slot_count)
+    {
+        uint32_t slot_count = writer->slot_count ? writer->slot_count * 2 : 4096;
+        uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+        struct source_address *addresses = realloc(writer->addresses, sizeof(struct source_address) * slot_count / 2);
+        if (slots == NULL || addresses == NULL)
+        {
+            free(slots);
+            if (addresses != NULL)
+                writer->addresses = addresses;
+            writer->columns[0].failed = true;
+            return 0;
+        }
+        writer->addresses = addresses;
+        for (uint32_t i = 0; i < writer->address_count; ++i)
+        {
+            uint64_t slot = siphash(&addresses[i], sizeof(struct source_address), global_hash_key);
+            while (slots[slot & (slot_count - 1)] != 0)
+                ++slot;
+            slots[slot & (slot_count - 1)] = i + 1;
+        }
+        free(writer->slots);
+        writer->slots = slots;
+        writer->slot_count = slot_count;
+    }
+
+    uint64_t slot = siphash(address, sizeof(*address), global_hash_key);
+    for (;; ++slot)
+    {
+        uint32_t index = writer->slots[slot & (writer->slot_count - 1)];
+        if (index == 0)
+            break;
+        if (memcmp(&writer->addresses[index - 1], address, sizeof(*address)) == 0)
+            return index - 1;
+    }
+    writer->addresses[writer->address_count] = *address;
+    writer->slots[slot & (writer->slot_count - 1)] = ++writer->address_count;
+    return writer->address_count - 1;
+}
+
+static size_t format_timestamp(int64_t time, char *output, size_t size)
+{
+    // timestamps are stored as they appear in the log, ignoring the timezone
+    time_t t = (time_t) (time / 1000);
+    struct tm tm;
+    size_t length = strftime(output, size, "%Y-%m-%d %H:%M:%S", gmtime_r(&t, &tm));
+    return length + (size_t) snprintf(output + length, size - length, ".%03d", (int) (time % 1000));
+}
+
+// Parse 'YYYY-MM-DD HH:MM:SS[.mmm]'; 'precise' tells whether the milliseconds were given
+static bool parse_timestamp_precise(const char *text, int64_t *time, bool *precise)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int millis = 0, length = 0, digits = 0;
+    if (sscanf(text, "%4d-%2d-%2d %2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &length) != 6)
+        return false;
+    *precise = text[length] == '.' && sscanf(text + length + 1, "%3d%n", &millis, &digits) == 1 && digits == 3;
+    if (!*precise)
+        millis = 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *time = (int64_t) timegm(&tm) * 1000 + millis;
+    return true;
+}
+
+static bool parse_timestamp(const char *text, int64_t *time)
+{
+    bool precise;
+    return parse_timestamp_precise(text, time, &precise);
+}
+
+static const char *CONNECTION_PREFIX = "Connection from ";
+
+static void archive_add_line(struct archive_writer *writer, const char *line, size_t length)
+{
+    // lines are only parsed if they can be formatted back exactly
+    enum line_kind kind = LINE_RAW;
+    int level = 0, port = -1;
+    int64_t time = 0;
+    struct source_address address;
+    const char *text = line;
+    size_t text_length = length;
+    char expected[128];
+
+    if (length > 27 && line[23] == ' ' && line[24] == '[' && parse_timestamp(line, &time) && time >= 0)
+    {
+        format_timestamp(time, expected, sizeof(expected));
+        while (level < 4 && (strncmp(line + 25, LOG_LEVELS[level], strlen(LOG_LEVELS[level])) != 0 ||
+               strncmp(line + 25 + strlen(LOG_LEVELS[level]), "] ", 2) != 0))
+            ++level;
+        if (level < 4 && memcmp(line, expected, 23) == 0)
+        {
+            kind = LINE_MESSAGE;
+            text = line + 27 + strlen(LOG_LEVELS[level]);
+            text_length = length - (size_t) (text - line);
+        }
+    }
+
+    if (kind == LINE_MESSAGE && text_length > strlen(CONNECTION_PREFIX) && strncmp(text, CONNECTION_PREFIX, strlen(CONNECTION_PREFIX)) == 0)
+    {
+        char host[INET6_ADDRSTRLEN];
+        int consumed = 0;
+        if (sscanf(text + strlen(CONNECTION_PREFIX), "%45s on port %d%n", host, &port, &consumed) == 2 &&
+            (size_t) consumed + strlen(CONNECTION_PREFIX) <= text_length && port >= 0 && port <= 65535)
+        {
+            memset(&address, 0, sizeof(address));
+            bool valid = false;
+            if (inet_pton(AF_INET, host, address.bytes + 12) == 1)
+            {
+                address.bytes[10] = address.bytes[11] = 0xFF;
+                valid = true;
+            }
+            else
+                valid = inet_pton(AF_INET6, host, address.bytes) == 1 && !source_is_ipv4(&address);
+            char formatted[INET6_ADDRSTRLEN];
+            int size = snprintf(expected, sizeof(expected), "%s%s on port %d", CONNECTION_PREFIX,
+                valid ? format_source(&address, formatted, sizeof(formatted)) : "", port);
+            if (valid && size == consumed + (int) strlen(CONNECTION_PREFIX) && memcmp(expected, text, (size_t) size) == 0)
+            {
+                text += size;
+                text_length -= (size_t) size;
+                kind = text_length > 0 ? LINE_CONNECTION_SUFFIX : LINE_CONNECTION;
+            }
+        }
+        if (kind == LINE_MESSAGE)
+            port = -1;
+    }
+
+    writer->kinds[writer->lines] = (uint8_t) ((int) kind << 4 | (kind == LINE_RAW ? 0 : level));
+    writer->ports[writer->lines] = kind >= LINE_CONNECTION ? port : -1;
+    if (kind != LINE_RAW)
+    {
+        int64_t delta = time - writer->previous_time;
+        buffer_varint(&writer->columns[COLUMN_TIME], zigzag_encode(delta - writer->previous_delta));
+        writer->previous_time = time;
+        writer->previous_delta = delta;
+        if (!writer->has_time || writer->lines == 0)
+            writer->first_time = time;
+        writer->last_time = time;
+        writer->has_time = true;
+    }
+    if (kind >= LINE_CONNECTION)
+        buffer_varint(&writer->columns[COLUMN_ADDRESS], archive_address(writer, &address));
+    if (kind != LINE_CONNECTION)
+    {
+        buffer_varint(&writer->columns[COLUMN_TEXT], text_length);
+        buffer_append(&writer->columns[COLUMN_TEXT], text, text_length);
+    }
+    if (++writer->lines == ARCHIVE_BLOCK)
+        archive_flush_block(writer);
+}
+
+/*
+ * Archive file format:
+ *
+ *   "NBAR", version, 3 reserved bytes
+ *   blocks of up to 4096 lines: line count and one section for each column
+ *   section with the address dictionary: count, then (family, address) for each entry
+ *   section with the block index: count, then (offset, lines, first time, last time)
+ *   offsets of the dictionary and index sections (8 bytes each) and "NBAR"
+ *
+ * Each section is the length, the data and the CRC-32 of the data.
+ */
+static int archive_logs(int count, char * const *files)
+{
+    struct archive_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    if ((writer.file = fopen(global_archive_output, "wb")) == NULL)
+    {
+        fprintf(stderr, "Unable to create '%s'\n", global_archive_output);
+        return 1;
+    }
+    random_bytes(global_hash_key, sizeof(global_hash_key));
+    archive_write(&writer, "NBAR\1\0\0\0", 8);
+
+    uint64_t input_size = 0, line_count = 0;
+    char *line = NULL;
+    size_t capacity = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        FILE *input = fopen(files[i], "rt");
+        if (input == NULL)
+        {
+            fprintf(stderr, "Unable to open '%s'\n", files[i]);
+            writer.columns[0].failed = true;
+            break;
+        }
+        ssize_t length = 0;
+        while ((length = getline(&line, &capacity, input)) >= 0)
+        {
+            input_size += (uint64_t) length;
+            ++line_count;
+            if (length > 0 && line[length - 1] == '\n')
+                --length;
+            archive_add_line(&writer, line, (size_t) length);
+        }
+        fclose(input);
+    }
+    free(line);
+    archive_flush_block(&writer);
+
+    struct buffer dictionary = {0};
+    buffer_varint(&dictionary, writer.address_count);
+    for (uint32_t i = 0; i < writer.address_count; ++i)
+    {
+        bool ipv4 = source_is_ipv4(&writer.addresses[i]);
+        buffer_append(&dictionary, ipv4 ? "\4" : "\6", 1);
+        buffer_append(&dictionary, writer.addresses[i].bytes + (ipv4 ? 12 : 0), ipv4 ? 4 : 16);
+    }
+    uint8_t footer[20];
+    write_le64(footer, writer.offset);
+    archive_write_section(&writer, &dictionary);
+
+    struct buffer index = {0};
+    buffer_varint(&index, writer.block_count);
+    buffer_append(&index, writer.index.data, writer.index.size);
+    write_le64(footer + 8, writer.offset);
+    archive_write_section(&writer, &index);
+    memcpy(footer + 16, "NBAR", 4);
+    archive_write(&writer, footer, sizeof(footer));
+
+    bool failed = writer.columns[0].failed || dictionary.failed || index.failed || writer.index.failed;
+    if (fclose(writer.file) != 0)
+        failed = true;
+    for (int c = 0; c < COLUMN_COUNT; ++c)
+        free(writer.columns[c].data);
+    free(writer.addresses);
+    free(writer.slots);
+    free(writer.index.data);
+    free(dictionary.data);
+    free(index.data);
+    if (failed)
+    {
+        fprintf(stderr, "Unable to write '%s'\n", global_archive_output);
+        return 1;
+    }
+    fprintf(stderr, "Archived %" PRIu64 " lines: %" PRIu64 " bytes to %" PRIu64 " bytes (%.1fx smaller)\n",
+        line_count, input_size, writer.offset, writer.offset ? (double) input_size / (double) writer.offset : 0.0);
+    return 0;
+}
+
+// Locate a section and check its checksum; return NULL if it's invalid
+static const uint8_t *archive_read_section(const uint8_t *input, const uint8_t *limit, const uint8_t **data, size_t *size)
+{
+    uint64_t length = 0;
+    if ((input = read_varint(input, limit, &length)) == NULL || (uint64_t) (limit - input) < length + 4)
+        return NULL;
+    uint32_t crc = (uint32_t) input[length] | (uint32_t) input[length + 1] << 8 | (uint32_t) input[length + 2] << 16 | (uint32_t) input[length + 3] << 24;
+    if (crc32(input, (size_t) length) != crc)
+        return NULL;
+    *data = input;
+    *size = (size_t) length;
+    return input + length + 4;
+}
+
+static bool extract_block(const uint8_t *input, const uint8_t *limit, const struct source_address *addresses, uint64_t address_count,
+    int64_t from, int64_t to, int64_t time)
+{
+    uint64_t lines = 0;
+    const uint8_t *columns[COLUMN_COUNT], *ends[COLUMN_COUNT];
+    if ((input = read_varint(input, limit, &lines)) == NULL || lines > ARCHIVE_BLOCK)
+        return false;
+    for (int c = 0; c < COLUMN_COUNT; ++c)
+    {
+        size_t size = 0;
+        if ((input = archive_read_section(input, limit, &columns[c], &size)) == NULL)
+            return false;
+        ends[c] = columns[c] + size;
+    }
+
+    uint64_t count = 0;
+    int ports[ARCHIVE_BLOCK];
+    if ((columns[COLUMN_PORT] = read_varint(columns[COLUMN_PORT], ends[COLUMN_PORT], &count)) == NULL || count > ARCHIVE_BLOCK)
+        return false;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t port = 0;
+        if ((columns[COLUMN_PORT] = read_varint(columns[COLUMN_PORT], ends[COLUMN_PORT], &port)) == NULL)
+            return false;
+        ports[i] = (int) port;
+    }
+
+    int64_t previous_delta = 0, previous_time = 0;
+    uint64_t run = 0;
+    uint8_t kind = 0;
+    for (uint64_t i = 0; i < lines; ++i)
+    {
+        if (run == 0)
+        {
+            if ((columns[COLUMN_KIND] = read_varint(columns[COLUMN_KIND], ends[COLUMN_KIND], &run)) == NULL ||
+                columns[COLUMN_KIND] >= ends[COLUMN_KIND] || run == 0)
+                return false;
+            kind = *columns[COLUMN_KIND]++;
+        }
+        --run;
+
+        char line[256];
+        size_t length = 0;
+        uint64_t value = 0;
+        int level = kind & 0x0F;
+        if ((kind >> 4) != LINE_RAW)
+        {
+            if ((columns[COLUMN_TIME] = read_varint(columns[COLUMN_TIME], ends[COLUMN_TIME], &value)) == NULL || level > LOG_DEBUG)
+                return false;
+            previous_delta += zigzag_decode(value);
+            previous_time += previous_delta;
+            time = previous_time;
+            length = format_timestamp(time, line, sizeof(line));
+            length += (size_t) snprintf(line + length, sizeof(line) - length, " [%s] ", LOG_LEVELS[level]);
+        }
+        if ((kind >> 4) >= LINE_CONNECTION)
+        {
+            uint64_t port = 0;
+            char address[INET6_ADDRSTRLEN];
+            if ((columns[COLUMN_ADDRESS] = read_varint(columns[COLUMN_ADDRESS], ends[COLUMN_ADDRESS], &value)) == NULL || value >= address_count ||
+                (columns[COLUMN_PORT] = read_varint(columns[COLUMN_PORT], ends[COLUMN_PORT], &port)) == NULL || port >= count)
+                return false;
+            length += (size_t) snprintf(line + length, sizeof(line) - length, "%s%s on port %d", CONNECTION_PREFIX,
+                format_source(&addresses[value], address, sizeof(address)), ports[port]);
+        }
+        const uint8_t *text = NULL;
+        uint64_t text_length = 0;
+        if ((kind >> 4) != LINE_CONNECTION)
+        {
+            if ((columns[COLUMN_TEXT] = read_varint(columns[COLUMN_TEXT], ends[COLUMN_TEXT], &text_length)) == NULL ||
+                (uint64_t) (ends[COLUMN_TEXT] - columns[COLUMN_TEXT]) < text_length)
+                return false;
+            text = columns[COLUMN_TEXT];
+            columns[COLUMN_TEXT] += text_length;
+        }
+
+        // lines without timestamp go along with the previous ones
+        if (time < from || time > to)
+            continue;
+        fwrite(line, 1, length, stdout);
+        if (text != NULL)
+            fwrite(text, 1, (size_t) text_length, stdout);
+        fputc('\n', stdout);
+    }
+    return true;
+}
+
+static int extract_logs()
+{
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    bool precise = true;
+    if ((global_extract_from != NULL && !parse_timestamp(global_extract_from, &from)) ||
+        (global_extract_to != NULL && !parse_timestamp_precise(global_extract_to, &to, &precise)))
+    {
+        fprintf(stderr, "Invalid time range; use the format 'YYYY-MM-DD HH:MM:SS[.mmm]'\n");
+        return 1;
+    }
+    // the lines have milliseconds, so an end given in seconds includes the whole second
+    if (!precise)
+        to += 999;
+
+    FILE *file = fopen(global_extract_input, "rb");
+    uint8_t *data = NULL;
+    long size = 0;
+    bool result = file != NULL && fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 28 && fseek(file, 0, SEEK_SET) == 0 &&
+        (data = malloc((size_t) size)) != NULL && fread(data, 1, (size_t) size, file) == (size_t) size &&
+        memcmp(data, "NBAR\1", 5) == 0 && memcmp(data + size - 4, "NBAR", 4) == 0;
+    if (file != NULL)
+        fclose(file);
+
+    // address dictionary
+    const uint8_t *limit = data + size - 20;
+    uint64_t dictionary_offset = result ? read_le64(limit) : 0;
+    uint64_t index_offset = result ? read_le64(limit + 8) : 0;
+    const uint8_t *section = NULL;
+    size_t section_size = 0;
+    uint64_t address_count = 0;
+    struct source_address *addresses = NULL;
+    result = result && dictionary_offset < (uint64_t) size && index_offset < (uint64_t) size &&
+        archive_read_section(data + dictionary_offset, limit, &section, &section_size) != NULL &&
+        (section = read_varint(section, section + section_size, &address_count)) != NULL && address_count <= section_size &&
+        (addresses = calloc(address_count + 1, sizeof(struct source_address))) != NULL;
+    const uint8_t *end = section + section_size;
+    for (uint64_t i = 0; result && i < address_count; ++i)
+    {
+        size_t length = section < end && *section == 4 ? 4 : 16;
+        if ((size_t) (end - section) < length + 1)
+            result = false;
+        else
+        {
+            if (length == 4)
+                addresses[i].bytes[10] = addresses[i].bytes[11] = 0xFF;
+            memcpy(addresses[i].bytes + 16 - length, section + 1, length);
+            section += length + 1;
+        }
+    }
+
+    // blocks in the time range
+    uint64_t block_count = 0;
+    result = result && archive_read_section(data + index_offset, limit, &section, &section_size) != NULL &&
+        (section = read_varint(section, section + section_size, &block_count)) != NULL;
+    end = section + section_size;
+    int64_t previous_last = INT64_MIN;
+    for (uint64_t i = 0; result && i < block_count; ++i)
+    {
+        uint64_t offset = 0, lines = 0, first = 0, last = 0;
+        if ((section = read_varint(section, end, &offset)) == NULL || (section = read_varint(section, end, &lines)) == NULL ||
+            (section = read_varint(section, end, &first)) == NULL || (section = read_varint(section, end, &last)) == NULL ||
+            offset >= dictionary_offset)
+        {
+            result = false;
+            break;
+        }
+        int64_t first_time = zigzag_decode(first), last_time = zigzag_decode(last);
+        if (last_time >= from && first_time <= to)
+            result = extract_block(data + offset, data + dictionary_offset, addresses, address_count, from, to, previous_last);
+        previous_last = last_time;
+    }
+
+    free(addresses);
+    free(data);
+    if (!result)
+    {
+        fprintf(stderr, "Unable to read '%s' or the archive is corrupted\n", global_extract_input);
+        return 1;
+    }
+    return 0;
+}
+
+// Self profiling
+
+static const char *const STAGE_NAMES[] = { "accept", "log" };
+
+static int profile_open(uint32_t type, uint64_t config, int leader)
+{
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attributes.disabled = leader < 0;
+    // unprivileged processes may only count user space
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Open the counters of this thread for each stage; containers usually don't allow it
+static void profile_start()
+{
+    static const uint32_t TYPES[PROFILE_COUNTERS] = { PERF_TYPE_SOFTWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE };
+    static const uint64_t CONFIGS[PROFILE_COUNTERS] = { PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES };
+
+    global_profile_counters = true;
+    for (int s = 0; s < STAGES; ++s)
+    {
+        struct profile_group *group = &global_profile[s];
+        memset(group, 0, sizeof(*group));
+        for (int c = 0; c < PROFILE_COUNTERS; ++c)
+            group->fds[c] = -1;
+        for (int c = 0; c < PROFILE_COUNTERS; ++c)
+        {
+            group->fds[c] = profile_open(TYPES[c], CONFIGS[c], c == 0 ? -1 : group->fds[0]);
+            group->slots[c] = group->fds[c] < 0 ? -1 : group->count++;
+            if (group->fds[0] < 0)
+                break;
+        }
+        if (group->fds[0] < 0)
+            global_profile_counters = false;
+    }
+    if (global_profile_counters)
+    {
+        log_message(LOG_INFO, "Self profiling with %s counters",
+            global_profile[0].fds[PROFILE_CYCLES] >= 0 ? "hardware and software" : "software perf");
+        return;
+    }
+    int err = errno;
+    for (int s = 0; s < STAGES; ++s)
+    {
+        for (int c = 0; c < PROFILE_COUNTERS; ++c)
+        {
+            if (global_profile[s].fds[c] >= 0)
+                close(global_profile[s].fds[c]);
+            global_profile[s].fds[c] = -1;
+        }
+    }
+    log_message(LOG_INFO, "Performance counters are unavailable (%s); self profiling with the thread CPU time", strerror(err));
+}
+
+static void profile_stop()
+{
+    for (int s = 0; s < STAGES; ++s)
+    {
+        for (int c = 0; c < PROFILE_COUNTERS; ++c)
+        {
+            if (global_profile[s].fds[c] >= 0)
+                close(global_profile[s].fds[c]);
+        }
+    }
+}
+
+static void profile_begin(enum profile_stage stage)
+{
+    if (global_profile_counters)
+        ioctl(global_profile[stage].fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    else
+        global_profile[stage].cpu_start = clock_read_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static void profile_end(enum profile_stage stage)
+{
+    if (global_profile_counters)
+        ioctl(global_profile[stage].fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    else
+        global_profile[stage].cpu_total += (uint64_t) (clock_read_ns(CLOCK_THREAD_CPUTIME_ID) - global_profile[stage].cpu_start);
+}
+
+// Read the whole group at once, scaled if the counters were multiplexed
+static bool profile_read(const struct profile_group *group, uint64_t *values)
+{
+    uint64_t data[3 + PROFILE_COUNTERS];
+    if (read(group->fds[0], data, sizeof(data)) < (ssize_t) (3 * sizeof(uint64_t)) || data[0] != (uint64_t) group->count)
+        return false;
+    double scale = data[2] > 0 && data[2] < data[1] ? (double) data[1] / (double) data[2] : 1.0;
+    for (int c = 0; c < PROFILE_COUNTERS; ++c)
+        values[c] = group->slots[c] < 0 ? 0 : (uint64_t) ((double) data[3 + group->slots[c]] * scale);
+    return true;
+}
+
+// Log the cost per event of each stage since the previous stats line
+static void stats_report(int64_t now)
+{
+    uint64_t events[STAGES] = { 0, global_log_lines };
+    for (int p = 0; p < global_port_count; ++p)
+        events[STAGE_ACCEPT] += global_hits[p];
+
+    for (int s = 0; s < STAGES; ++s)
+    {
+        struct profile_group *group = &global_profile[s];
+        uint64_t count = events[s] - global_stats_events[s];
+        global_stats_events[s] = events[s];
+        double per = count > 0 ? 1.0 / (double) count : 0.0;
+
+        char line[256];
+        size_t length = 0;
+        if (global_profile_counters)
+        {
+            uint64_t values[PROFILE_COUNTERS];
+            if (!profile_read(group, values))
+                continue;
+            static const char *const NAMES[PROFILE_COUNTERS] = { NULL, "cycles", "instructions", "cache misses", "context switches" };
+            length += (size_t) snprintf(line, sizeof(line), "%.2f us CPU", (double) (values[0] - group->previous[0]) * per / 1000.0);
+            for (int c = 1; c < PROFILE_COUNTERS && length < sizeof(line); ++c)
+            {
+                if (group->slots[c] >= 0)
+                    length += (size_t) snprintf(line + length, sizeof(line) - length, ", %.2f %s", (double) (values[c] - group->previous[c]) * per, NAMES[c]);
+            }
+            memcpy(group->previous, values, sizeof(values));
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "%.2f us CPU", (double) group->cpu_total * per / 1000.0);
+            group->cpu_total = 0;
+        }
+        log_message(LOG_INFO, "Stats %s: %" PRIu64 " %s, per %s: %s", STAGE_NAMES[s], count,
+            s == STAGE_ACCEPT ? "connections" : "lines", s == STAGE_ACCEPT ? "connection" : "line", line);
+    }
+    // the stages don't block, so most switches happen while waiting for events
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0)
+    {
+        long switches = usage.ru_nvcsw + usage.ru_nivcsw;
+        log_message(LOG_INFO, "Stats: %ld context switches of the event loop", switches - global_stats_switches);
+        global_stats_switches = switches;
+    }
+    global_stats_deadline = now + global_stats_interval * 1000;
+}
+
+// Reverse DNS
+
+// Name of the PTR record of the source, e.g. '4.3.2.1.in-addr.arpa'
+static void rdns_ptr_name(const struct source_address *source, char *output, size_t size)
+{
+    size_t length = 0;
+    if (source_is_ipv4(source))
+    {
+        for (int i = 15; i >= 12; --i)
+            length += (size_t) snprintf(output + length, size - length, "%d.", source->bytes[i]);
+        snprintf(output + length, size - length, "in-addr.arpa");
+        return;
+    }
+    for (int i = 15; i >= 0; --i)
+        length += (size_t) snprintf(output + length, size - length, "%x.%x.", source->bytes[i] & 0xF, source->bytes[i] >> 4);
+    snprintf(output + length, size - length, "ip6.arpa");
+}
+
+// Decode the name at 'offset', following compression pointers; return the offset after it or 0 if it's invalid
+static size_t dns_name(const uint8_t *message, size_t size, size_t offset, char *output, size_t output_size)
+{
+    size_t end = 0;
+    size_t length = 0;
+    for (int jumps = 0; jumps < 16 && offset < size; )
+    {
+        uint8_t label = message[offset];
+        if ((label & 0xC0) == 0xC0)
+        {
+            if (offset + 1 >= size)
+                return 0;
+            if (end == 0)
+                end = offset + 2;
+            offset = (size_t) (label & 0x3F) << 8 | message[offset + 1];
+            ++jumps;
+            continue;
+        }
+        if ((label & 0xC0) != 0 || offset + 1 + label > size || length + label + 1 >= output_size)
+            return 0;
+        if (label == 0)
+        {
+            output[length > 0 ? length - 1 : 0] = '\0';
+            return end != 0 ? end : offset + 1;
+        }
+        // the names end up in the log, so only the characters of host names are kept
+        for (size_t i = 0; i < label; ++i)
+        {
+            char c = (char) message[offset + 1 + i];
+            output[length++] = isalnum((unsigned char) c) || c == '-' || c == '_' ? c : '?';
+        }
+        output[length++] = '.';
+        offset += 1 + (size_t) label;
+    }
+    return 0;
+}
+
+static struct rdns_entry *rdns_lookup(const struct source_address *source, int64_t now, bool create)
+{
+    uint64_t hash = siphash(source, sizeof(*source), global_hash_key);
+    struct rdns_entry *victim = NULL;
+    for (uint64_t i = 0; i < RDNS_PROBES; ++i)
+    {
+        struct rdns_entry *entry = &global_rdns->cache[(hash + i) & (RDNS_SLOTS - 1)];
+        if (entry->expires > now && memcmp(&entry->source, source, sizeof(*source)) == 0)
+            return entry;
+        // prefer empty or expired slots, then the entry closer to expire
+        if (victim == NULL || (victim->expires > now && entry->expires < victim->expires))
+            victim = entry;
+    }
+    if (!create)
+        return NULL;
+    victim->source = *source;
+    victim->name[0] = '\0';
+    return victim;
+}
+
+static void rdns_store(const struct source_address *source, const char *name, uint32_t ttl, int64_t now)
+{
+    struct rdns_entry *entry = rdns_lookup(source, now, true);
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    // a zero TTL still answers the connections waiting for it
+    entry->expires = now + (int64_t) (ttl < 1 ? 1 : (ttl > RDNS_MAX_TTL ? RDNS_MAX_TTL : ttl)) * 1000;
+}
+
+static struct rdns_query *rdns_find_query(const struct source_address *source)
+{
+    for (int q = 0; q < MAX_RDNS_QUERIES; ++q)
+    {
+        struct rdns_query *query = &global_rdns->queries[q];
+        if (query->deadline > 0 && memcmp(&query->source, source, sizeof(*source)) == 0)
+            return query;
+    }
+    return NULL;
+}
+
+// Send a PTR query for the source unless one is in flight; give up when every slot is in use
+static void rdns_send(const struct source_address *source, int64_t now)
+{
+    if (rdns_find_query(source) != NULL)
+        return;
+    struct rdns_query *query = NULL;
+    for (int q = 0; q < MAX_RDNS_QUERIES && query == NULL; ++q)
+    {
+        if (global_rdns->queries[q].deadline == 0)
+            query = &global_rdns->queries[q];
+    }
+    if (query == NULL)
+        return;
+
+    uint8_t message[RDNS_MESSAGE];
+    query->id = (uint16_t) siphash(&global_rdns->sent, sizeof(global_rdns->sent), global_rdns->key);
+    ++global_rdns->sent;
+    // header with the recursion desired flag and one question
+    uint8_t header[12] = {(uint8_t) (query->id >> 8), (uint8_t) query->id, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+    memcpy(message, header, sizeof(header));
+    size_t size = sizeof(header);
+    char name[80];
+    rdns_ptr_name(source, name, sizeof(name));
+    char *saveptr = NULL;
+    for (char *label = strtok_r(name, ".", &saveptr); label != NULL; label = strtok_r(NULL, ".", &saveptr))
+    {
+        size_t length = strlen(label);
+        message[size++] = (uint8_t) length;
+        memcpy(message + size, label, length);
+        size += length;
+    }
+    // root label, type PTR and class IN
+    uint8_t question[5] = {0, 0, 12, 0, 1};
+    memcpy(message + size, question, sizeof(question));
+    size += sizeof(question);
+
+    if (send(global_rdns->fd, message, size, MSG_DONTWAIT) != (ssize_t) size)
+    {
+        rdns_store(source, "", RDNS_RETRY, now);
+        return;
+    }
+    query->source = *source;
+    query->deadline = now + global_rdns_timeout;
+}
+
+static void rdns_answer(const uint8_t *message, size_t size, int64_t now)
+{
+    // a response with one question
+    if (size < 12 || (message[2] & 0x80) == 0 || message[4] != 0 || message[5] != 1)
+        return;
+    uint16_t id = (uint16_t) (message[0] << 8 | message[1]);
+    struct rdns_query *query = NULL;
+    for (int q = 0; q < MAX_RDNS_QUERIES && query == NULL; ++q)
+    {
+        if (global_rdns->queries[q].deadline > 0 && global_rdns->queries[q].id == id)
+            query = &global_rdns->queries[q];
+    }
+    if (query == NULL)
+        return;
+    char expected[80];
+    char name[256];
+    rdns_ptr_name(&query->source, expected, sizeof(expected));
+    size_t offset = dns_name(message, size, 12, name, sizeof(name));
+    if (offset == 0 || offset + 4 > size || strcasecmp(name, expected) != 0)
+        return;
+    offset += 4;
+    query->deadline = 0;
+
+    int code = message[3] & 0x0F;
+    if ((message[2] & 0x02) != 0 || (code != 0 && code != 3))
+    {
+        // truncated or failed: try again later
+        rdns_store(&query->source, "", RDNS_RETRY, now);
+        return;
+    }
+    int answers = message[6] << 8 | message[7];
+    for (int a = 0; a < answers && code == 0; ++a)
+    {
+        offset = dns_name(message, size, offset, name, sizeof(name));
+        if (offset == 0 || offset + 10 > size)
+            break;
+        const uint8_t *record = message + offset;
+        uint32_t ttl = (uint32_t) record[4] << 24 | (uint32_t) record[5] << 16 | (uint32_t) record[6] << 8 | record[7];
+        size_t length = (size_t) (record[8] << 8 | record[9]);
+        offset += 10;
+        if (record[1] == 12 && record[0] == 0 && record[3] == 1 && record[2] == 0 &&
+            dns_name(message, size, offset, name, sizeof(name)) != 0)
+        {
+            rdns_store(&query->source, name, ttl, now);
+            return;
+        }
+        offset += length;
+    }
+    // the address has no name
+    rdns_store(&query->source, "", RDNS_NEGATIVE_TTL, now);
+}
+
+static void rdns_emit(const struct rdns_event *event, const char *name)
+{
+    char text[INET6_ADDRSTRLEN];
+    format_source(&event->source, text, sizeof(text));
+    if (name[0] != '\0')
+        log_message_at(event->time, LOG_INFO, "Connection from %s on port %d%s%s (%s)", text, event->port, event->tag, event->detail, name);
+    else
+        log_message_at(event->time, LOG_INFO, "Connection from %s on port %d%s%s", text, event->port, event->tag, event->detail);
+}
+
+// Log the waiting connections in order while their names are known or their time is up
+static void rdns_flush(int64_t now)
+{
+    while (global_rdns->event_count > 0)
+    {
+        struct rdns_event *event = &global_rdns->events[global_rdns->event_head];
+        const struct rdns_entry *entry = rdns_lookup(&event->source, now, false);
+        if (entry == NULL && now < event->time + global_rdns_timeout && rdns_find_query(&event->source) != NULL)
+            break;
+        rdns_emit(event, entry != NULL ? entry->name : "");
+        global_rdns->event_head = (global_rdns->event_head + 1) % RDNS_EVENTS;
+        --global_rdns->event_count;
+    }
+}
+
+// Log the connection now if the name of the source is known, otherwise once it's resolved or after the timeout
+static void rdns_connection(const struct source_address *source, int port, const char *tag, const char *detail, int64_t now)
+{
+    const struct rdns_entry *entry = rdns_lookup(source, now, false);
+    struct rdns_event event;
+    event.source = *source;
+    event.time = now;
+    event.port = port;
+    event.tag = tag;
+    snprintf(event.detail, sizeof(event.detail), "%s", detail);
+    if (entry != NULL && global_rdns->event_count == 0)
+    {
+        rdns_emit(&event, entry->name);
+        return;
+    }
+    if (entry == NULL)
+        rdns_send(source, now);
+    // a full queue never holds the connections back
+    if (global_rdns->event_count == RDNS_EVENTS)
+    {
+        rdns_emit(&global_rdns->events[global_rdns->event_head], "");
+        global_rdns->event_head = (global_rdns->event_head + 1) % RDNS_EVENTS;
+        --global_rdns->event_count;
+    }
+    global_rdns->events[(global_rdns->event_head + global_rdns->event_count) % RDNS_EVENTS] = event;
+    ++global_rdns->event_count;
+    rdns_flush(now);
+}
+
+static void rdns_receive(int fd, short revents)
+{
+    (void) revents;
+    int64_t now = current_time_ms();
+    uint8_t message[RDNS_MESSAGE];
+    ssize_t size;
+    while ((size = recv(fd, message, sizeof(message), MSG_DONTWAIT)) >= 0)
+        rdns_answer(message, (size_t) size, now);
+    rdns_flush(now);
+}
+
+static int64_t rdns_deadline()
+{
+    int64_t deadline = INT64_MAX;
+    for (int q = 0; q < MAX_RDNS_QUERIES; ++q)
+    {
+        if (global_rdns->queries[q].deadline > 0 && global_rdns->queries[q].deadline < deadline)
+            deadline = global_rdns->queries[q].deadline;
+    }
+    if (global_rdns->event_count > 0 && global_rdns->events[global_rdns->event_head].time + global_rdns_timeout < deadline)
+        deadline = global_rdns->events[global_rdns->event_head].time + global_rdns_timeout;
+    return deadline;
+}
+
+static void rdns_expire(int64_t now)
+{
+    // a resolver that doesn't answer isn't asked again for a while
+    for (int q = 0; q < MAX_RDNS_QUERIES; ++q)
+    {
+        struct rdns_query *query = &global_rdns->queries[q];
+        if (query->deadline > 0 && query->deadline <= now)
+        {
+            query->deadline = 0;
+            rdns_store(&query->source, "", RDNS_RETRY, now);
+        }
+    }
+    rdns_flush(now);
+}
+
+static bool rdns_start()
+{
+    struct sockaddr_storage address;
+    socklen_t size = 0;
+    if (!parse_endpoint(global_rdns_target, &address, &size))
+    {
+        log_message(LOG_ERROR, "Invalid resolver address '%s'", global_rdns_target);
+        return false;
+    }
+    struct rdns *rdns = calloc(1, sizeof(struct rdns));
+    if (rdns == NULL)
+        return false;
+    random_bytes(rdns->key, sizeof(rdns->key));
+    rdns->fd = socket(address.ss_family, SOCK_DGRAM, 0);
+    if (rdns->fd < 0 || connect(rdns->fd, (const struct sockaddr *) &address, size) < 0 || !watch_add(rdns->fd, POLLIN, rdns_receive))
+    {
+        log_error("Unable to create the resolver socket", errno);
+        if (rdns->fd >= 0)
+            close(rdns->fd);
+        free(rdns);
+        return false;
+    }
+    global_rdns = rdns;
+    log_message(LOG_INFO, "Resolving the names of the sources with %s", global_rdns_target);
+    return true;
+}
+
+static void rdns_stop()
+{
+    if (global_rdns == NULL)
+        return;
+    // the connections still waiting are logged with the names known so far
+    int64_t now = current_time_ms();
+    for (; global_rdns->event_count > 0; --global_rdns->event_count)
+    {
+        const struct rdns_event *event = &global_rdns->events[global_rdns->event_head];
+        const struct rdns_entry *entry = rdns_lookup(&event->source, now, false);
+        rdns_emit(event, entry != NULL ? entry->name : "");
+        global_rdns->event_head = (global_rdns->event_head + 1) % RDNS_EVENTS;
+    }
+    watch_remove(global_rdns->fd);
+    close(global_rdns->fd);
+    free(global_rdns);
+    global_rdns = NULL;
+}
+
+// Reputation
+
+// Seconds since the epoch of the table; a wall clock stepped back before it counts as the epoch
+static uint32_t reputation_time(int64_t now)
+{
+    return now > global_reputation_epoch ? (uint32_t) ((now - global_reputation_epoch) / 1000) : 0;
+}
+
+// Score of the entry at the given time; a time before its last hit (the clock was stepped back) doesn't decay it
+static double reputation_decayed(const struct reputation_entry *entry, uint32_t time)
+{
+    if (time <= entry->time)
+        return entry->score;
+    return entry->score * exp2(-(double) (time - entry->time) / global_reputation_half_life);
+}
+
+static struct reputation_entry *reputation_lookup(const struct source_address *source, uint32_t time)
+{
+    uint64_t hash = siphash(source, sizeof(*source), global_hash_key);
+    struct reputation_entry *victim = NULL;
+    double victim_score = 0;
+    for (uint64_t i = 0; i < REPUTATION_PROBES; ++i)
+    {
+        struct reputation_entry *entry = &global_reputations[(hash + i) & (REPUTATION_SLOTS - 1)];
+        if (entry->score == 0)
+        {
+            victim = entry;
+            break;
+        }
+        if (memcmp(&entry->source, source, sizeof(*source)) == 0)
+            return entry;
+        // prefer to evict the source with the lowest score
+        double score = reputation_decayed(entry, time);
+        if (victim == NULL || score < victim_score)
+        {
+            victim = entry;
+            victim_score = score;
+        }
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    victim->source = *source;
+    victim->time = time;
+    return victim;
+}
+
+// Add a connection to the score of the source and return whether the score exceeds the threshold, if any
+static bool reputation_hit(const struct source_address *source, int64_t now)
+{
+    uint32_t time = reputation_time(now);
+    struct reputation_entry *entry = reputation_lookup(source, time);
+    if (time < entry->time)
+        time = entry->time;
+    double score = reputation_decayed(entry, time) + 1;
+    entry->score = (float) score;
+    entry->time = time;
+    return global_reputation_threshold > 0 && score > global_reputation_threshold;
+}
+
+// Write the sources with the highest scores, decayed to the current time, as text
+static void reputation_export(int64_t now)
+{
+    global_reputation_deadline = now + REPUTATION_EXPORT;
+    uint32_t time = reputation_time(now);
+    const struct reputation_entry *top[REPUTATION_TOP];
+    double scores[REPUTATION_TOP];
+    int count = 0;
+    for (int i = 0; i < REPUTATION_SLOTS; ++i)
+    {
+        const struct reputation_entry *entry = &global_reputations[i];
+        if (entry->score == 0)
+            continue;
+        double score = reputation_decayed(entry, time);
+        if (count == REPUTATION_TOP && score <= scores[count - 1])
+            continue;
+        // insertion into the list sorted by decreasing score
+        int position = count < REPUTATION_TOP ? count++ : count - 1;
+        for (; position > 0 && scores[position - 1] < score; --position)
+        {
+            top[position] = top[position - 1];
+            scores[position] = scores[position - 1];
+        }
+        top[position] = entry;
+        scores[position] = score;
+    }
+
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", global_reputation_file);
+    FILE *file = fopen(temporary, "w");
+    bool result = file != NULL;
+    for (int i = 0; i < count && result; ++i)
+    {
+        char text[INET6_ADDRSTRLEN];
+        result = fprintf(file, "%.2f %s %u\n", scores[i], format_source(&top[i]->source, text, sizeof(text)), time - top[i]->time) > 0;
+    }
+    if (file != NULL && fclose(file) != 0)
+        result = false;
+    if (!result || rename(temporary, global_reputation_file) != 0)
+        log_message(LOG_ERROR, "Unable to write the reputation scores to '%s'", global_reputation_file);
+}
+
+static bool reputation_start()
+{
+    global_reputations = calloc(REPUTATION_SLOTS, sizeof(struct reputation_entry));
+    if (global_reputations == NULL)
+        return false;
+    global_reputation_epoch = current_time_ms();
+    global_reputation_deadline = global_reputation_epoch + REPUTATION_EXPORT;
+    return true;
+}
+
+static void reputation_stop()
+{
+    if (global_reputation_file != NULL && global_reputations != NULL)
+        reputation_export(current_time_ms());
+    free(global_reputations);
+}
+
+// Count a connection in every jail watching the port of the listener
+static void jail_connection(int listener, const struct source_address *source, int64_t now)
+{
+    for (int j = 0; j < global_jail_count; ++j)
+    {
+        if ((global_port_jails[listener] & (1 << j)) == 0 || !jail_hit(&global_jails[j], source, now))
+            continue;
+        char text[INET6_ADDRSTRLEN];
+        log_message(LOG_WARNING, "BAN %s (jail %s)", format_source(source, text, sizeof(text)), global_jails[j].name);
+        ++global_ban_count;
+        ban_source(source, global_jails[j].ban_buckets * global_jails[j].bucket_width, now);
+    }
+}
+
+// Count, log and close (or tarpit) one connection; 'client' is -1 for a connection observed without
+// accepting it, so there is no socket to close. The accept loops pass constant 'features', which drops
+// the checks of the modules they don't use
+static inline __attribute__((always_inline)) void handle_connection(int listener, const struct source_address *source, int client,
+                                                                     const char *detail, int64_t now, const unsigned int features)
+{
+    int p = global_listener_ports[listener];
+    const char *tag = global_listener_tags[listener];
+    ++global_hits[p];
+    if (features & FEATURE_SKETCH)
+        sketch_add(&global_sketches.sketches[p], source);
+    char text[INET6_ADDRSTRLEN];
+
+    // banned sources are dropped silently; the set is empty most of the time, which the length tells first
+    if ((features & FEATURE_BANS) && global_ban_length_total > 0 && ban_set_contains(source, now))
+    {
+        ++global_dropped;
+        if (features & FEATURE_FLIGHT)
+            flight_connection(FLIGHT_BANNED, source, global_ports[p], 0, now);
+        log_message(LOG_DEBUG, "Dropped connection from banned %s on port %d%s%s", format_source(source, text, sizeof(text)), global_ports[p], tag, detail);
+        if (client >= 0)
+            close(client);
+        return;
+    }
+    uint8_t action = resolve_action(p, source, now);
+    // sources seen often lately are only counted, so a persistent scanner doesn't flood the log; this is
+    // a runtime check rather than a feature bit, see 'accept_feature'
+    if (global_reputations != NULL && reputation_hit(source, now))
+        action &= (uint8_t) ~ACTION_LOG;
+    if (features & FEATURE_FLIGHT)
+        flight_connection(FLIGHT_CONNECTION, source, global_ports[p], action, now);
+
+    // log and close the connection; IPv4 sources are logged without the mapping prefix
+    if (action & ACTION_LOG)
+    {
+        // the line waits for the name of the source, at most for the timeout of the resolver; a runtime
+        // check rather than a feature bit, see 'accept_feature'
+        if (global_rdns != NULL)
+            rdns_connection(source, global_ports[p], tag, detail, now);
+        else
+            log_message(LOG_INFO, "Connection from %s on port %d%s%s", format_source(source, text, sizeof(text)), global_ports[p], tag, detail);
+        if (features & FEATURE_SENSOR)
+            sensor_add_event(source, global_ports[p], now);
+    }
+    else
+        log_message(LOG_DEBUG, "Counted connection from %s on port %d%s%s", format_source(source, text, sizeof(text)), global_ports[p], tag, detail);
+    if (client >= 0 && (action & ACTION_TARPIT))
+        tarpit_add(client, now);
+    else if (client >= 0)
+        close(client);
+
+    // the rules decide the ban per source, and only some ports have jails
+    if ((action & ACTION_BAN) && global_port_jails[p] != 0)
+        jail_connection(p, source, now);
+}
+
+// Handle a connection that wasn't accepted by the specialized accept loops: one observed without accepting
+// it, or one accepted on a listener behind balancers
+static void observe_connection(int listener, const struct source_address *source, int client, const char *detail, int64_t now)
+{
+    handle_connection(listener, source, client, detail, now, global_features);
+}
+
+static int find_port(int port)
+{
+    int p = 0;
+    while (p < global_port_count && global_ports[p] != port)
+        ++p;
+    return p < global_port_count ? p : -1;
+}
+
+// PROXY protocol
+
+static bool proxy_trusted(const struct source_address *source)
+{
+    for (int i = 0; i < global_proxy_source_count; ++i)
+    {
+        struct source_address masked;
+        mask_address(source, global_proxy_lengths[i], &masked);
+        if (memcmp(&masked, &global_proxy_sources[i], sizeof(masked)) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Parse a PROXY protocol v2 header; returns 1 when it's complete, 0 while it's incomplete and -1 if it's invalid
+static int proxy_parse(const uint8_t *data, size_t size, struct source_address *source, uint16_t *port, bool *local)
+{
+    static const uint8_t SIGNATURE[12] = { 0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A };
+    if (memcmp(data, SIGNATURE, size < 12 ? size : 12) != 0)
+        return -1;
+    if (size < 16)
+        return 0;
+    // version 2, command LOCAL or PROXY
+    if ((data[12] >> 4) != 2 || (data[12] & 0xF) > 1)
+        return -1;
+    size_t length = (size_t) data[14] << 8 | data[15];
+    if (16 + length > PROXY_HEADER_MAX)
+        return -1;
+    if (size < 16 + length)
+        return 0;
+
+    // the balancer's own connections, like health checks, carry no address
+    *local = (data[12] & 0xF) == 0;
+    if (*local)
+        return 1;
+    // TCP over IPv4 or IPv6
+    if (data[13] == 0x11 && length >= 12)
+    {
+        struct in_addr address;
+        memcpy(&address, data + 16, 4);
+        source_from_ipv4(&address, source);
+        memcpy(port, data + 24, 2);
+    }
+    else if (data[13] == 0x21 && length >= 36)
+    {
+        memcpy(source->bytes, data + 16, 16);
+        memcpy(port, data + 48, 2);
+    }
+    else
+        return -1;
+    *port = ntohs(*port);
+    return 1;
+}
+
+// Read what arrived of the header and handle the connection once it's complete; returns false while it isn't
+static bool proxy_read(struct proxy_client *client, int64_t now)
+{
+    ssize_t result = recv(client->fd, client->data + client->size, PROXY_HEADER_MAX - client->size, MSG_DONTWAIT);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+    char text[INET6_ADDRSTRLEN];
+    format_source(&client->balancer, text, sizeof(text));
+    if (result <= 0)
+    {
+        log_message(LOG_DEBUG, "Connection from balancer %s closed before the PROXY header", text);
+        watch_remove(client->fd);
+        close(client->fd);
+        return true;
+    }
+    client->size += (size_t) result;
+
+    struct source_address source;
+    uint16_t port = 0;
+    bool local = false;
+    int status = proxy_parse(client->data, client->size, &source, &port, &local);
+    if (status == 0)
+        return false;
+    // the descriptor is closed or handed over below, so its number may be reused by the time the caller runs
+    watch_remove(client->fd);
+    if (status < 0 || local)
+    {
+        if (status < 0)
+            log_message(LOG_WARNING, "Invalid PROXY header from balancer %s", text);
+        else
+            log_message(LOG_DEBUG, "Local connection from balancer %s", text);
+        close(client->fd);
+        return true;
+    }
+    char detail[INET6_ADDRSTRLEN + 40];
+    snprintf(detail, sizeof(detail), " (source port %u via %s)", (unsigned int) port, text);
+    observe_connection(client->listener, &source, client->fd, detail, now);
+    return true;
+}
+
+static void proxy_remove(int index)
+{
+    global_proxy_clients[index] = global_proxy_clients[--global_proxy_client_count];
+}
+
+static void proxy_receive(int fd, short revents)
+{
+    (void) revents;
+    for (int i = 0; i < global_proxy_client_count; ++i)
+    {
+        if (global_proxy_clients[i].fd != fd)
+            continue;
+        if (proxy_read(&global_proxy_clients[i], current_time_ms()))
+            proxy_remove(i);
+        return;
+    }
+}
+
+// Headers that don't arrive in time are given up, so slow balancers only hold their own slots
+static void proxy_expire(int64_t now)
+{
+    for (int i = 0; i < global_proxy_client_count;)
+    {
+        struct proxy_client *client = &global_proxy_clients[i];
+        if (client->deadline > now)
+        {
+            ++i;
+            continue;
+        }
+        char text[INET6_ADDRSTRLEN];
+        log_message(LOG_DEBUG, "Connection from balancer %s timed out before the PROXY header", format_source(&client->balancer, text, sizeof(text)));
+        watch_remove(client->fd);
+        close(client->fd);
+        proxy_remove(i);
+    }
+}
+
+static int64_t proxy_deadline()
+{
+    int64_t deadline = INT64_MAX;
+    for (int i = 0; i < global_proxy_client_count; ++i)
+    {
+        if (global_proxy_clients[i].deadline < deadline)
+            deadline = global_proxy_clients[i].deadline;
+    }
+    return deadline;
+}
+
+// Handle a connection from a balancer when its header is already there, and wait for it otherwise
+static void proxy_accept(int fd, int listener, const struct source_address *balancer, int64_t now)
+{
+    char text[INET6_ADDRSTRLEN];
+    if (global_proxy_client_count >= MAX_PROXY_CLIENTS)
+    {
+        log_message(LOG_DEBUG, "Dropped connection from balancer %s; too many pending PROXY headers", format_source(balancer, text, sizeof(text)));
+        close(fd);
+        return;
+    }
+    struct proxy_client *client = &global_proxy_clients[global_proxy_client_count];
+    client->fd = fd;
+    client->listener = listener;
+    client->deadline = now + PROXY_TIMEOUT;
+    client->balancer = *balancer;
+    client->size = 0;
+    if (proxy_read(client, now))
+        return;
+    if (!watch_add(fd, POLLIN, proxy_receive))
+    {
+        log_message(LOG_DEBUG, "Dropped connection from balancer %s; too many watches", format_source(balancer, text, sizeof(text)));
+        close(fd);
+        return;
+    }
+    ++global_proxy_client_count;
+}
+
+// Anomaly detection
+
+// Sample the rate of each port from its counter and compare it with the exponentially weighted mean and
+// variance of the previous samples; the accept path only increments the counters
+static void anomaly_sample(int64_t now)
+{
+    double elapsed = (double) (now - global_anomaly_time) / 1000.0;
+    global_anomaly_time = now;
+    global_anomaly_deadline = now + ANOMALY_PERIOD;
+    if (elapsed <= 0)
+        return;
+    ++global_anomaly_samples;
+    // a plain average until there are enough samples for the window
+    double alpha = fmax(1.0 / (double) global_anomaly_samples, 1.0 / ANOMALY_WINDOW);
+
+    for (int p = 0; p < global_port_count; ++p)
+    {
+        struct port_baseline *baseline = &global_baselines[p];
+        double rate = (double) (global_hits[p] - baseline->hits) / elapsed;
+        baseline->hits = global_hits[p];
+
+        // at least one connection per second of deviation, so quiet ports don't alert on a single probe
+        double deviation = sqrt(fmax(baseline->variance, 1.0));
+        double score = (rate - baseline->mean) / deviation;
+        if (global_anomaly_samples > ANOMALY_WARMUP)
+        {
+            if (!baseline->anomalous && score >= global_anomaly_threshold)
+            {
+                baseline->anomalous = true;
+                log_message(LOG_WARNING, "Anomaly on port %d: %.1f connections per second against a baseline of %.2f (z-score %.1f)",
+                    global_ports[p], rate, baseline->mean, score);
+            }
+            else if (baseline->anomalous && score < global_anomaly_threshold / 2)
+            {
+                baseline->anomalous = false;
+                log_message(LOG_INFO, "Connection rate on port %d back to its baseline: %.1f per second", global_ports[p], rate);
+            }
+        }
+        // outliers are clipped, so a burst doesn't hide the next ones, while a lasting change is still learned
+        double difference = rate - baseline->mean;
+        if (global_anomaly_samples > ANOMALY_WARMUP)
+            difference = fmin(fmax(difference, -global_anomaly_threshold * deviation), global_anomaly_threshold * deviation);
+        baseline->mean += alpha * difference;
+        baseline->variance = (1 - alpha) * (baseline->variance + alpha * difference * difference);
+    }
+}
+
+static void anomaly_start()
+{
+    int64_t now = current_time_ms();
+    for (int p = 0; p < global_port_count; ++p)
+        global_baselines[p].hits = global_hits[p];
+    global_anomaly_time = now;
+    global_anomaly_deadline = now + ANOMALY_PERIOD;
+}
+
+// StatsD
+
+static void statsd_time(struct statsd_timer *timer, uint64_t duration)
+{
+    if (timer->count == 0 || duration < timer->min)
+        timer->min = duration;
+    if (duration > timer->max)
+        timer->max = duration;
+    timer->sum += duration;
+    ++timer->count;
+}
+
+// Append a metric to the current datagram, or start another one if it doesn't fit
+static void statsd_append(struct statsd *statsd, const char *name, double value, const char *type)
+{
+    char line[STATSD_LINE];
+    int length = snprintf(line, sizeof(line), "%s.%s:%.15g|%s", STATSD_PREFIX, name, value, type);
+    if (length <= 0 || (size_t) length >= sizeof(line))
+        return;
+    if (statsd->sizes[statsd->count] + (size_t) length + 1 > STATSD_DATAGRAM)
+    {
+        if (statsd->count + 1 >= STATSD_DATAGRAMS)
+            return;
+        ++statsd->count;
+    }
+    size_t *size = &statsd->sizes[statsd->count];
+    char *datagram = statsd->datagrams[statsd->count];
+    if (*size > 0)
+        datagram[(*size)++] = '\n';
+    memcpy(datagram + *size, line, (size_t) length);
+    *size += (size_t) length;
+}
+
+static double statsd_counter(uint64_t current, uint64_t *previous)
+{
+    uint64_t delta = current - *previous;
+    *previous = current;
+    return (double) delta;
+}
+
+// Send what was aggregated since the previous flush in a few datagrams, all of them with one system call
+static void statsd_flush(int64_t now)
+{
+    struct statsd *statsd = global_statsd;
+    statsd->count = 0;
+    memset(statsd->sizes, 0, sizeof(statsd->sizes));
+
+    // StatsD counts missing counters as zero, so idle ports take no space
+    uint64_t total = 0;
+    for (int p = 0; p < global_port_count; ++p)
+    {
+        if (global_hits[p] == statsd->hits[p])
+            continue;
+        char name[32];
+        total += global_hits[p] - statsd->hits[p];
+        snprintf(name, sizeof(name), "connections.port_%d", global_ports[p]);
+        statsd_append(statsd, name, statsd_counter(global_hits[p], &statsd->hits[p]), "c");
+    }
+    statsd_append(statsd, "connections", (double) total, "c");
+    statsd_append(statsd, "dropped", statsd_counter(global_dropped, &statsd->dropped), "c");
+    statsd_append(statsd, "bans", statsd_counter(global_ban_count, &statsd->bans), "c");
+    statsd_append(statsd, "log_lines", statsd_counter(global_log_lines, &statsd->log_lines), "c");
+    statsd_append(statsd, "tarpits", global_tarpit_count, "g");
+    struct statsd_timer *timer = &statsd->wakeup;
+    statsd_append(statsd, "wakeup.count", (double) timer->count, "c");
+    if (timer->count > 0)
+    {
+        statsd_append(statsd, "wakeup.min", (double) timer->min / 1e6, "g");
+        statsd_append(statsd, "wakeup.mean", (double) timer->sum / (double) timer->count / 1e6, "g");
+        statsd_append(statsd, "wakeup.max", (double) timer->max / 1e6, "g");
+    }
+    memset(timer, 0, sizeof(*timer));
+
+    struct iovec vectors[STATSD_DATAGRAMS];
+    struct mmsghdr messages[STATSD_DATAGRAMS];
+    memset(messages, 0, sizeof(messages));
+    int count = statsd->count + 1;
+    for (int i = 0; i < count; ++i)
+    {
+        vectors[i].iov_base = statsd->datagrams[i];
+        vectors[i].iov_len = statsd->sizes[i];
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    // a refused datagram is reported by the next call; the metrics are lost either way
+    if (sendmmsg(statsd->fd, messages, (unsigned int) count, MSG_DONTWAIT) < 0)
+        log_message(LOG_DEBUG, "Unable to send the metrics to StatsD: %s", strerror(errno));
+    global_statsd_deadline = now + global_statsd_interval * 1000;
+}
+
+static bool statsd_start()
+{
+    struct sockaddr_storage address;
+    socklen_t size = 0;
+    if (!parse_endpoint(global_statsd_target, &address, &size))
+    {
+        log_message(LOG_ERROR, "Invalid StatsD address '%s'", global_statsd_target);
+        return false;
+    }
+    struct statsd *statsd = calloc(1, sizeof(struct statsd));
+    if (statsd == NULL)
+        return false;
+    statsd->fd = socket(address.ss_family, SOCK_DGRAM, 0);
+    if (statsd->fd < 0 || connect(statsd->fd, (const struct sockaddr *) &address, size) < 0)
+    {
+        log_error("Unable to create the StatsD socket", errno);
+        if (statsd->fd >= 0)
+            close(statsd->fd);
+        free(statsd);
+        return false;
+    }
+    memcpy(statsd->hits, global_hits, sizeof(statsd->hits));
+    global_statsd = statsd;
+    global_statsd_deadline = current_time_ms() + global_statsd_interval * 1000;
+    log_message(LOG_INFO, "Sending metrics to StatsD at %s every %d seconds", global_statsd_target, global_statsd_interval);
+    return true;
+}
+
+static void statsd_stop()
+{
+    if (global_statsd == NULL)
+        return;
+    statsd_flush(current_time_ms());
+    close(global_statsd->fd);
+    free(global_statsd);
+    global_statsd = NULL;
+}
+
+// Accept loops
+
+// Every caller passes constants for 'mode' and 'features', so each copy has no checks for them
+static inline __attribute__((always_inline)) void accept_connections(struct pollfd *wait_list, int events,
+                                                                      const enum listen_mode mode, const unsigned int features)
+{
+    for (int l = 0; l < global_listener_count && events > 0; ++l)
+    {
+        if ((wait_list[l].revents & POLLIN) == 0)
+            continue;
+        --events;
+        wait_list[l].revents = 0;
+
+        // drain the queue, so a burst doesn't overflow the backlog while waiting for 'poll'
+        for (int n = 0; n < ACCEPT_BATCH; ++n)
+        {
+            struct sockaddr_in6 address;
+            socklen_t len = sizeof(address);
+            int client = accept(wait_list[l].fd, (struct sockaddr *) &address, &len);
+            if (client < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error("Error accepting connection", errno);
+                break;
+            }
+
+            int64_t now = current_time_ms();
+            struct source_address source;
+            if (mode == LISTEN_IPV4)
+                source_from_ipv4(&((const struct sockaddr_in *) &address)->sin_addr, &source);
+            else
+                memcpy(source.bytes, &address.sin6_addr, 16);
+            handle_connection(l, &source, client, "", now, features);
+        }
+    }
+}
+
+typedef void (*accept_loop)(struct pollfd *wait_list, int events);
+
+#define ACCEPT_FEATURE_SETS(X, mode) \
+    X(mode, 0)  X(mode, 1)  X(mode, 2)  X(mode, 3)  X(mode, 4)  X(mode, 5)  X(mode, 6)  X(mode, 7) \
+    X(mode, 8)  X(mode, 9)  X(mode, 10) X(mode, 11) X(mode, 12) X(mode, 13) X(mode, 14) X(mode, 15)
+
+#define ACCEPT_VARIANTS(X) \
+    ACCEPT_FEATURE_SETS(X, LISTEN_IPV4) \
+    ACCEPT_FEATURE_SETS(X, LISTEN_IPV6) \
+    ACCEPT_FEATURE_SETS(X, LISTEN_DUAL)
+
+#define ACCEPT_DEFINE(mode, features) \
+    static void accept_##mode##_##features(struct pollfd *wait_list, int events) \
+    { \
+        accept_connections(wait_list, events, mode, features); \
+    }
+#define ACCEPT_ENTRY(mode, features) accept_##mode##_##features,
+
+ACCEPT_VARIANTS(ACCEPT_DEFINE)
+
+// Indexed by 'mode * 16 + features'
+static const accept_loop ACCEPT_LOOPS[] =
+{
+    ACCEPT_VARIANTS(ACCEPT_ENTRY)
+};
+
+// Accept loop of the listeners behind balancers, which looks at every source and takes the generic path
+static void accept_proxied(struct pollfd *wait_list, int events)
+{
+    for (int l = 0; l < global_listener_count && events > 0; ++l)
+    {
+        if ((wait_list[l].revents & POLLIN) == 0)
+            continue;
+        --events;
+        wait_list[l].revents = 0;
+        for (int n = 0; n < ACCEPT_BATCH; ++n)
+        {
+            struct sockaddr_in6 address;
+            socklen_t len = sizeof(address);
+            int client = accept(wait_list[l].fd, (struct sockaddr *) &address, &len);
+            if (client < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_error("Error accepting connection", errno);
+                break;
+            }
+
+            int64_t now = current_time_ms();
+            struct source_address source;
+            if (address.sin6_family == AF_INET)
+                source_from_ipv4(&((const struct sockaddr_in *) &address)->sin_addr, &source);
+            else
+                memcpy(source.bytes, &address.sin6_addr, 16);
+            // connections from balancers are counted once their header tells the client's address
+            if (proxy_trusted(&source))
+                proxy_accept(client, l, &source, now);
+            else
+                observe_connection(l, &source, client, "", now);
+        }
+    }
+}
+
+// Choose the accept loop once, after every module has started
+static accept_loop accept_select()
+{
+    unsigned int features = 0;
+    if (global_sketch_file != NULL)
+        features |= FEATURE_SKETCH;
+    if (global_jail_count > 0 || global_gossip_target_count > 0)
+        features |= FEATURE_BANS;
+    if (global_flight != NULL)
+        features |= FEATURE_FLIGHT;
+    if (global_sensor != NULL)
+        features |= FEATURE_SENSOR;
+    // the other paths check the same bits at runtime
+    global_features = features;
+    if (global_proxy_source_count > 0)
+        return accept_proxied;
+    enum listen_mode mode = global_dual_stack ? LISTEN_DUAL : (global_family == AF_INET6 ? LISTEN_IPV6 : LISTEN_IPV4);
+    return ACCEPT_LOOPS[(unsigned int) mode * 16 + features];
+}
+
+
+static long bpf_call(int command, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, command, attr, sizeof(*attr));
+}
+
+static struct bpf_insn bpf_instruction(uint8_t code, uint8_t destination, uint8_t source, int16_t offset, int32_t immediate)
+{
+    struct bpf_insn instruction;
+    memset(&instruction, 0, sizeof(instruction));
+    instruction.code = code;
+    instruction.dst_reg = destination & 0xFu;
+    instruction.src_reg = source & 0xFu;
+    instruction.off = offset;
+    instruction.imm = immediate;
+    return instruction;
+}
+
+// Load the XDP program that redirects the IPv4 TCP SYNs to the listened ports into the socket of the
+// receive queue, and passes every other packet to the stack
+static int xdp_program(int map_fd)
+{
+    struct bpf_insn code[32 + MAX_PORTS];
+    int length = 0;
+    int pass[8];
+    int pass_count = 0;
+    int redirect[MAX_PORTS];
+
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0);
+    // Ethernet, IPv4 without options and TCP headers; the 16-bit fields are loaded in network order and
+    // converted to the host's with BPF_END, so the constants they're compared with are plain numbers
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 54);
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0);
+    code[length++] = bpf_instruction(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16);
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x0800);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14, 0);
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 23, 0);
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_TCP);
+    // first fragment only
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 20, 0);
+    code[length++] = bpf_instruction(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16);
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x1FFF);
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0);
+    // SYN without ACK
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 47, 0);
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x12);
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x02);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 36, 0);
+    code[length++] = bpf_instruction(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16);
+    for (int p = 0; p < global_port_count; ++p)
+    {
+        redirect[p] = length;
+        code[length++] = bpf_instruction(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 0, global_ports[p]);
+    }
+    pass[pass_count++] = length;
+    code[length++] = bpf_instruction(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+
+    // bpf_redirect_map(map, rx_queue_index, XDP_PASS), which passes the packet if the queue has no socket
+    for (int p = 0; p < global_port_count; ++p)
+        code[redirect[p]].off = (int16_t) (length - redirect[p] - 1);
+    code[length++] = bpf_instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0);
+    code[length++] = bpf_instruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    code[length++] = bpf_instruction(0, 0, 0, 0, 0);
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    code[length++] = bpf_instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    code[length++] = bpf_instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    for (int i = 0; i < pass_count; ++i)
+        code[pass[i]].off = (int16_t) (length - pass[i] - 1);
+    code[length++] = bpf_instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    code[length++] = bpf_instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t) (uintptr_t) code;
+    attr.insn_cnt = (uint32_t) length;
+    attr.license = (uint64_t) (uintptr_t) "Apache-2.0";
+    int fd = (int) bpf_call(BPF_PROG_LOAD, &attr);
+    if (fd < 0)
+    {
+        // load it again to show why the verifier rejected it
+        int err = errno;
+        static char verifier[4096];
+        attr.log_level = 1;
+        attr.log_buf = (uint64_t) (uintptr_t) verifier;
+        attr.log_size = sizeof(verifier);
+        if (bpf_call(BPF_PROG_LOAD, &attr) < 0 && verifier[0] != '\0')
+            log_message(LOG_ERROR, "XDP program rejected: %s", verifier);
+        errno = err;
+    }
+    return fd;
+}
+
+static bool xdp_ring_map(int fd, struct xdp_ring *ring, const struct xdp_ring_offset *offsets, size_t entry_size, off_t page)
+{
+    ring->map_size = (size_t) offsets->desc + XDP_FRAMES * entry_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, page);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        return false;
+    }
+    uint8_t *base = ring->map;
+    ring->producer = (uint32_t *) (base + offsets->producer);
+    ring->consumer = (uint32_t *) (base + offsets->consumer);
+    ring->flags = (uint32_t *) (base + offsets->flags);
+    ring->entries = base + offsets->desc;
+    return true;
+}
+
+// Attach the program in the driver if it supports XDP, and fall back to the generic hook otherwise
+static bool xdp_attach(struct xdp_engine *engine, unsigned int interface, bool *native)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = (uint32_t) engine->program_fd;
+    attr.link_create.target_ifindex = interface;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    engine->link_fd = (int) bpf_call(BPF_LINK_CREATE, &attr);
+    *native = engine->link_fd >= 0;
+    if (engine->link_fd < 0)
+    {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        engine->link_fd = (int) bpf_call(BPF_LINK_CREATE, &attr);
+    }
+    return engine->link_fd >= 0;
+}
+
+static void xdp_stop()
+{
+    struct xdp_engine *engine = global_xdp;
+    if (engine == NULL)
+        return;
+    // closing the link detaches the program
+    if (engine->link_fd >= 0)
+        close(engine->link_fd);
+    if (engine->program_fd >= 0)
+        close(engine->program_fd);
+    if (engine->map_fd >= 0)
+        close(engine->map_fd);
+    if (engine->fd >= 0)
+    {
+        watch_remove(engine->fd);
+        close(engine->fd);
+    }
+    struct xdp_ring *rings[] = { &engine->fill, &engine->completion, &engine->rx };
+    for (int r = 0; r < 3; ++r)
+    {
+        if (rings[r]->map != NULL)
+            munmap(rings[r]->map, rings[r]->map_size);
+    }
+    if (engine->umem != NULL)
+        munmap(engine->umem, (size_t) XDP_FRAMES * XDP_FRAME_SIZE);
+    free(engine);
+    global_xdp = NULL;
+}
+
+// Count each SYN once and handle it as a connection
+static void xdp_syn(const uint8_t *frame, int64_t now)
+{
+    struct xdp_engine *engine = global_xdp;
+    struct in_addr address;
+    uint16_t source_port;
+    uint16_t destination;
+    uint32_t sequence;
+    memcpy(&address, frame + 26, 4);
+    memcpy(&source_port, frame + 34, 2);
+    memcpy(&destination, frame + 36, 2);
+    memcpy(&sequence, frame + 38, 4);
+    int p = find_port(ntohs(destination));
+    if (p < 0)
+        return;
+
+    // nothing answers the SYN, so the client retransmits it with the same port and sequence number
+    uint64_t key = ((uint64_t) address.s_addr << 32 | sequence) ^ ((uint64_t) source_port << 48) ^ (uint64_t) destination;
+    uint64_t *seen = &engine->seen[(key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - 10)];
+    if (*seen == key)
+        return;
+    *seen = key;
+
+    struct source_address source;
+    source_from_ipv4(&address, &source);
+    observe_connection(p, &source, -1, "", now);
+}
+
+// Parse the received frames in place and give them back to the kernel through the fill ring
+static void xdp_receive(int fd, short revents)
+{
+    (void) fd;
+    (void) revents;
+    struct xdp_engine *engine = global_xdp;
+    uint32_t consumer = *engine->rx.consumer;
+    uint32_t producer = __atomic_load_n(engine->rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t fill = *engine->fill.producer;
+    const struct xdp_desc *descriptors = engine->rx.entries;
+    uint64_t *frames = engine->fill.entries;
+    int64_t now = current_time_ms();
+    for (; consumer != producer; ++consumer)
+    {
+        const struct xdp_desc *descriptor = &descriptors[consumer % XDP_FRAMES];
+        if (descriptor->len >= 54)
+            xdp_syn(engine->umem + descriptor->addr, now);
+        // every frame fits in the fill ring, so it never overflows
+        frames[fill++ % XDP_FRAMES] = descriptor->addr - descriptor->addr % XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(engine->fill.producer, fill, __ATOMIC_RELEASE);
+    __atomic_store_n(engine->rx.consumer, consumer, __ATOMIC_RELEASE);
+}
+
+static bool xdp_failed(const char *step)
+{
+    log_message(LOG_ERROR, "Unable to %s for interface %s: %s", step, global_xdp_interface, strerror(errno));
+    xdp_stop();
+    return false;
+}
+
+static bool xdp_start()
+{
+    unsigned int interface = if_nametoindex(global_xdp_interface);
+    if (interface == 0)
+    {
+        log_message(LOG_ERROR, "Unknown interface '%s'", global_xdp_interface);
+        return false;
+    }
+    struct xdp_engine *engine = calloc(1, sizeof(struct xdp_engine));
+    if (engine == NULL)
+        return false;
+    engine->fd = engine->map_fd = engine->program_fd = engine->link_fd = -1;
+    global_xdp = engine;
+
+    // the UMEM, where the kernel writes the frames, with a ring of the same size for each direction
+    engine->umem = mmap(NULL, (size_t) XDP_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (engine->umem == MAP_FAILED)
+    {
+        engine->umem = NULL;
+        return xdp_failed("allocate the UMEM");
+    }
+    engine->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (engine->fd < 0)
+        return xdp_failed("create the AF_XDP socket");
+    struct xdp_umem_reg umem;
+    memset(&umem, 0, sizeof(umem));
+    umem.addr = (uint64_t) (uintptr_t) engine->umem;
+    umem.len = (uint64_t) XDP_FRAMES * XDP_FRAME_SIZE;
+    umem.chunk_size = XDP_FRAME_SIZE;
+    int size = XDP_FRAMES;
+    struct xdp_mmap_offsets offsets;
+    socklen_t length = sizeof(offsets);
+    if (setsockopt(engine->fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) < 0 ||
+        setsockopt(engine->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(engine->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(engine->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        getsockopt(engine->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &length) < 0 ||
+        !xdp_ring_map(engine->fd, &engine->fill, &offsets.fr, sizeof(uint64_t), (off_t) XDP_UMEM_PGOFF_FILL_RING) ||
+        !xdp_ring_map(engine->fd, &engine->completion, &offsets.cr, sizeof(uint64_t), (off_t) XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        !xdp_ring_map(engine->fd, &engine->rx, &offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING))
+        return xdp_failed("set up the rings");
+
+    // the map from receive queues to sockets and the program redirecting to it
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = (uint32_t) global_xdp_queue + 1;
+    engine->map_fd = (int) bpf_call(BPF_MAP_CREATE, &attr);
+    if (engine->map_fd < 0)
+        return xdp_failed("create the socket map");
+    engine->program_fd = xdp_program(engine->map_fd);
+    if (engine->program_fd < 0)
+        return xdp_failed("load the XDP program");
+    bool native = false;
+    if (!xdp_attach(engine, interface, &native))
+        return xdp_failed("attach the XDP program");
+
+    // zero copy needs the driver's support, otherwise the kernel copies each redirected frame to the UMEM
+    struct sockaddr_xdp address;
+    memset(&address, 0, sizeof(address));
+    address.sxdp_family = AF_XDP;
+    address.sxdp_ifindex = interface;
+    address.sxdp_queue_id = (uint32_t) global_xdp_queue;
+    address.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    bool zero_copy = native && bind(engine->fd, (const struct sockaddr *) &address, sizeof(address)) == 0;
+    address.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+    if (!zero_copy && bind(engine->fd, (const struct sockaddr *) &address, sizeof(address)) < 0)
+        return xdp_failed("bind the AF_XDP socket");
+    uint32_t key = (uint32_t) global_xdp_queue;
+    uint32_t value = (uint32_t) engine->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t) engine->map_fd;
+    attr.key = (uint64_t) (uintptr_t) &key;
+    attr.value = (uint64_t) (uintptr_t) &value;
+    if (bpf_call(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+        return xdp_failed("add the socket to the map");
+
+    // hand every frame to the kernel
+    uint64_t *frames = engine->fill.entries;
+    for (uint32_t i = 0; i < XDP_FRAMES; ++i)
+        frames[i] = (uint64_t) i * XDP_FRAME_SIZE;
+    __atomic_store_n(engine->fill.producer, *engine->fill.producer + XDP_FRAMES, __ATOMIC_RELEASE);
+
+    watch_add(engine->fd, POLLIN, xdp_receive);
+    log_message(LOG_INFO, "Capturing SYNs on interface %s, queue %d (%s XDP, %s mode)", global_xdp_interface, global_xdp_queue,
+        native ? "native" : "generic", zero_copy ? "zero-copy" : "copy");
+    return true;
+}
+
+// Conntrack events
+
+// The alignment macros of the netlink headers mix signed and unsigned types
+#define NETLINK_ALIGN(length) (((size_t) (length) + 3) & ~(size_t) 3)
+#define NETLINK_ATTRIBUTE     NETLINK_ALIGN(sizeof(struct nlattr))
+
+// Find an attribute among the ones in 'data', ignoring the nested flag
+static const struct nlattr *netlink_attribute(const uint8_t *data, size_t size, uint16_t type)
+{
+    while (size >= NETLINK_ATTRIBUTE)
+    {
+        const struct nlattr *attribute = (const struct nlattr *) data;
+        if (attribute->nla_len < NETLINK_ATTRIBUTE || attribute->nla_len > size)
+            return NULL;
+        if ((attribute->nla_type & NLA_TYPE_MASK) == type)
+            return attribute;
+        size_t length = NETLINK_ALIGN(attribute->nla_len);
+        if (length >= size)
+            return NULL;
+        data += length;
+        size -= length;
+    }
+    return NULL;
+}
+
+static const struct nlattr *netlink_nested(const struct nlattr *parent, uint16_t type)
+{
+    if (parent == NULL)
+        return NULL;
+    return netlink_attribute((const uint8_t *) parent + NETLINK_ATTRIBUTE, (size_t) parent->nla_len - NETLINK_ATTRIBUTE, type);
+}
+
+static size_t netlink_payload(const struct nlattr *attribute, const void **payload)
+{
+    if (attribute == NULL)
+        return 0;
+    *payload = (const uint8_t *) attribute + NETLINK_ATTRIBUTE;
+    return (size_t) attribute->nla_len - NETLINK_ATTRIBUTE;
+}
+
+// Handle a new TCP or UDP flow from its original direction, as if the source had connected to the port
+static void conntrack_flow(const struct nlmsghdr *header, int64_t now)
+{
+    size_t offset = NETLINK_ALIGN(sizeof(struct nlmsghdr)) + NETLINK_ALIGN(sizeof(struct nfgenmsg));
+    if (header->nlmsg_type != ((NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW) || header->nlmsg_len < offset)
+        return;
+    const struct nlattr *tuple = netlink_attribute((const uint8_t *) header + offset, header->nlmsg_len - offset, CTA_TUPLE_ORIG);
+    const struct nlattr *addresses = netlink_nested(tuple, CTA_TUPLE_IP);
+    const struct nlattr *protocol = netlink_nested(tuple, CTA_TUPLE_PROTO);
+
+    const void *number = NULL;
+    const void *port = NULL;
+    if (netlink_payload(netlink_nested(protocol, CTA_PROTO_NUM), &number) != 1 ||
+        (*(const uint8_t *) number != IPPROTO_TCP && *(const uint8_t *) number != IPPROTO_UDP) ||
+        netlink_payload(netlink_nested(protocol, CTA_PROTO_DST_PORT), &port) != 2)
+        return;
+    uint16_t destination;
+    memcpy(&destination, port, 2);
+    int p = find_port(ntohs(destination));
+    if (p < 0)
+        return;
+
+    struct source_address source;
+    const void *address = NULL;
+    if (netlink_payload(netlink_nested(addresses, CTA_IP_V4_SRC), &address) == 4)
+    {
+        struct in_addr ipv4;
+        memcpy(&ipv4, address, 4);
+        source_from_ipv4(&ipv4, &source);
+    }
+    else if (netlink_payload(netlink_nested(addresses, CTA_IP_V6_SRC), &address) == 16)
+        memcpy(source.bytes, address, 16);
+    else
+        return;
+    observe_connection(p, &source, -1, "", now);
+}
+
+// Drain the events in batches, a few of them per wake up so the other watches aren't starved
+static void conntrack_receive(int fd, short revents)
+{
+    (void) revents;
+    static uint8_t buffers[CONNTRACK_BATCH][CONNTRACK_MESSAGE];
+    struct iovec vectors[CONNTRACK_BATCH];
+    struct mmsghdr messages[CONNTRACK_BATCH];
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < CONNTRACK_BATCH; ++i)
+    {
+        vectors[i].iov_base = buffers[i];
+        vectors[i].iov_len = CONNTRACK_MESSAGE;
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int64_t now = current_time_ms();
+    for (int round = 0; round < CONNTRACK_ROUNDS; ++round)
+    {
+        int count = recvmmsg(fd, messages, CONNTRACK_BATCH, MSG_DONTWAIT, NULL);
+        if (count < 0)
+        {
+            // the kernel drops the events that don't fit in the receive buffer and reports it once
+            if (errno == ENOBUFS)
+            {
+                ++global_conntrack_lost;
+                log_message(LOG_WARNING, "Conntrack events were lost because the receive buffer overflowed (%" PRIu64 " times)", global_conntrack_lost);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("Error receiving conntrack events", errno);
+            break;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            // a datagram may hold several messages
+            size_t length = messages[i].msg_len;
+            for (size_t offset = 0; offset + sizeof(struct nlmsghdr) <= length;)
+            {
+                const struct nlmsghdr *header = (const struct nlmsghdr *) (buffers[i] + offset);
+                if (header->nlmsg_len < sizeof(struct nlmsghdr) || header->nlmsg_len > length - offset)
+                    break;
+                conntrack_flow(header, now);
+                offset += NETLINK_ALIGN(header->nlmsg_len);
+            }
+        }
+        if (count < CONNTRACK_BATCH)
+            break;
+    }
+}
+
+static bool conntrack_start()
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if (fd < 0)
+    {
+        log_error("Unable to create the conntrack socket", errno);
+        return false;
+    }
+    // a burst of new flows must fit while the event loop is busy; forcing it needs CAP_NET_ADMIN
+    int size = CONNTRACK_BUFFER;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        log_message(LOG_WARNING, "Unable to enlarge the conntrack receive buffer; %s", strerror(errno));
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    int group = NFNLGRP_CONNTRACK_NEW;
+    if (bind(fd, (const struct sockaddr *) &address, sizeof(address)) < 0 ||
+        setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0 || !set_non_blocking(fd))
+    {
+        log_error("Unable to subscribe to conntrack events", errno);
+        close(fd);
+        return false;
+    }
+    global_conntrack_fd = fd;
+    watch_add(fd, POLLIN, conntrack_receive);
+    log_message(LOG_INFO, "Receiving new flows from conntrack");
+    return true;
+}
+
+static void conntrack_stop()
+{
+    if (global_conntrack_fd < 0)
+        return;
+    watch_remove(global_conntrack_fd);
+    close(global_conntrack_fd);
+    global_conntrack_fd = -1;
+}
+
+static int64_t min_deadline(int64_t a, int64_t b)
+{
+    return a < b ? a : b;
+}
+
+// Return how long 'poll' may wait before some deadline is due
+static int poll_timeout(int64_t now)
+{
+    int64_t deadline = INT64_MAX;
+    if (global_tarpit_count > 0)
+        deadline = global_tarpits[global_tarpit_head].deadline;
+    if (global_proxy_client_count > 0)
+        deadline = min_deadline(deadline, proxy_deadline());
+    if (global_rdns != NULL)
+        deadline = min_deadline(deadline, rdns_deadline());
+    if (global_sensor != NULL && global_sensor->fd < 0)
+        deadline = min_deadline(deadline, global_sensor->retry_at);
+    if (global_sensor != NULL && global_sensor->batch_count > 0)
+        deadline = min_deadline(deadline, global_sensor->batch_deadline);
+    if (global_merge_count > 0)
+        deadline = min_deadline(deadline, global_merge_heap[0].time + COLLECTOR_DELAY);
+    if (global_gossip != NULL)
+        deadline = min_deadline(deadline, global_gossip->batch_size > 0 ? global_gossip->batch_deadline : global_gossip->rotate_at);
+    if (global_sketch_file != NULL)
+        deadline = min_deadline(deadline, global_sketch_deadline);
+    if (global_mapped_log.map != NULL)
+        deadline = min_deadline(deadline, global_log_sync_deadline);
+    if (global_stats_interval > 0)
+        deadline = min_deadline(deadline, global_stats_deadline);
+    if (global_statsd != NULL)
+        deadline = min_deadline(deadline, global_statsd_deadline);
+    if (global_anomaly_threshold > 0)
+        deadline = min_deadline(deadline, global_anomaly_deadline);
+    if (global_reputation_file != NULL && global_reputations != NULL)
+        deadline = min_deadline(deadline, global_reputation_deadline);
+    if (global_firewall_file != NULL)
+        deadline = min_deadline(deadline, global_firewall_deadline);
+
+    if (deadline == INT64_MAX)
+        return -1;
+    return deadline <= now ? 0 : (deadline - now > 60000 ? 60000 : (int) (deadline - now));
+}
+
+static void run_deadlines(int64_t now)
+{
+    // anchored after each wake up, before timestamping the new connections
+    if (global_clock_started && now >= global_clock_deadline)
+    {
+        clock_anchor();
+        global_clock_deadline = now + CLOCK_ANCHOR_DELAY;
+    }
+    tarpit_expire(now);
+    if (global_proxy_client_count > 0)
+        proxy_expire(now);
+    if (global_rdns != NULL)
+        rdns_expire(now);
+    if (global_sensor != NULL)
+    {
+        if (global_sensor->fd < 0 && now >= global_sensor->retry_at)
+            sensor_connect(now);
+        if (global_sensor->batch_count > 0 && now >= global_sensor->batch_deadline)
+        {
+            sensor_flush_batch();
+            sensor_pump();
+        }
+    }
+    while (global_merge_count > 0 && global_merge_heap[0].time + COLLECTOR_DELAY <= now)
+        collector_emit();
+    if (global_gossip != NULL)
+    {
+        if (global_gossip->batch_size > 0 && now >= global_gossip->batch_deadline)
+            gossip_flush();
+        if (now >= global_gossip->rotate_at)
+        {
+            memcpy(global_gossip->bloom[1], global_gossip->bloom[0], sizeof(global_gossip->bloom[0]));
+            memset(global_gossip->bloom[0], 0, sizeof(global_gossip->bloom[0]));
+            global_gossip->rotate_at = now + GOSSIP_ROTATION;
+        }
+    }
+    if (global_sketch_file != NULL && now >= global_sketch_deadline)
+        sketch_export(now);
+    if (global_stats_interval > 0 && now >= global_stats_deadline)
+        stats_report(now);
+    if (global_statsd != NULL && now >= global_statsd_deadline)
+        statsd_flush(now);
+    if (global_anomaly_threshold > 0 && now >= global_anomaly_deadline)
+        anomaly_sample(now);
+    if (global_reputation_file != NULL && global_reputations != NULL && now >= global_reputation_deadline)
+        reputation_export(now);
+    if (global_firewall_file != NULL && now >= global_firewall_deadline)
+        firewall_export(now);
+    // the mapped log is written back in the background
+    if (global_mapped_log.map != NULL && now >= global_log_sync_deadline)
+    {
+        msync(global_mapped_log.map, global_mapped_log.segment_size, MS_ASYNC);
+        global_log_sync_deadline = now + LOG_SYNC_DELAY;
+    }
+}
+
+// Logging takes locks and allocates, so the event loop logs the signal once 'poll' returns
+static void signal_handler(int signum)
+{
+    global_stop_signal = signum;
+    global_running = 0;
+}
+
+static void reopen_handler(int signum)
+{
+    (void) signum;
+    global_reopen = 1;
+}
+
+// Measure the cost of the clocks and the drift of the fast clock against the wall clock
+static int clock_info()
+{
+    clock_start();
+    printf("Source: %s\n", global_clock_tsc ? "TSC" : "CLOCK_MONOTONIC_COARSE");
+    printf("Invariant TSC: %s\n", clock_tsc_invariant() ? "yes" : "no");
+    if (global_clock_tsc)
+        printf("TSC frequency: %.3f MHz\n", (double) (UINT64_C(1) << CLOCK_SHIFT) * 1000.0 / (double) global_clock_mult);
+
+    static const char *const NAMES[] = { "fast clock", "CLOCK_REALTIME", "CLOCK_MONOTONIC_COARSE" };
+    for (int c = 0; c < 3; ++c)
+    {
+        const int calls = 10000000;
+        volatile int64_t sink = 0;
+        int64_t start = clock_read_ns(CLOCK_MONOTONIC);
+        for (int i = 0; i < calls; ++i)
+        {
+            if (c == 0)
+                sink = current_time_ms();
+            else
+                sink = clock_read_ns(c == 1 ? CLOCK_REALTIME : CLOCK_MONOTONIC_COARSE);
+        }
+        (void) sink;
+        printf("%-24s %6.1f ns per call\n", NAMES[c], (double) (clock_read_ns(CLOCK_MONOTONIC) - start) / calls);
+    }
+
+    // drift accumulated during each anchoring interval
+    for (int i = 0; i < 5; ++i)
+    {
+        struct timespec delay = { CLOCK_ANCHOR_DELAY / 1000, (CLOCK_ANCHOR_DELAY % 1000) * 1000000 };
+        nanosleep(&delay, NULL);
+        int64_t fast = clock_fast_ns();
+        int64_t wall = clock_read_ns(CLOCK_REALTIME);
+        printf("After %d ms: fast clock - wall clock = %+" PRId64 " us\n", CLOCK_ANCHOR_DELAY, (fast - wall) / 1000);
+        clock_anchor();
+    }
+    return 0;
+}
+
+// Connect to the listeners through the loopback interface as fast as possible, e.g. to train a PGO build
+static int run_workload()
+{
+    bool ipv6 = global_family == AF_INET6;
+    bool ipv4 = !ipv6 || global_dual_stack;
+    long connected = 0;
+    int64_t start = clock_read_ns(CLOCK_MONOTONIC);
+    for (long i = 0; i < global_workload; ++i)
+    {
+        int port = global_ports[i % global_port_count];
+        bool use_ipv6 = ipv6 && (!ipv4 || (i / global_port_count) % 2 == 1);
+        int fd = socket(use_ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            perror("socket");
+            return 1;
+        }
+        int result;
+        if (use_ipv6)
+        {
+            struct sockaddr_in6 address;
+            memset(&address, 0, sizeof(address));
+            address.sin6_family = AF_INET6;
+            address.sin6_port = htons((uint16_t) port);
+            address.sin6_addr = in6addr_loopback;
+            result = connect(fd, (const struct sockaddr *) &address, sizeof(address));
+        }
+        else
+        {
+            // a different source for each connection, so the listener sees many addresses
+            struct sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl((uint32_t) (0x7F010000 + (uint32_t) i % 0xFE0000));
+            if (bind(fd, (const struct sockaddr *) &address, sizeof(address)) != 0)
+                perror("bind");
+            address.sin_port = htons((uint16_t) port);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            result = connect(fd, (const struct sockaddr *) &address, sizeof(address));
+        }
+        // wait for the listener to close the connection, so the backlog never overflows
+        if (result == 0)
+        {
+            struct pollfd wait = { fd, POLLIN, 0 };
+            poll(&wait, 1, 1000);
+            ++connected;
+        }
+        // reset the connection instead of leaving it in TIME_WAIT
+        struct linger linger = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close(fd);
+    }
+    double elapsed = (double) (clock_read_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    printf("%ld connections in %.3f s (%.0f per second), %ld failed\n", connected, elapsed, (double) connected / elapsed,
+        global_workload - connected);
+    return connected == global_workload ? 0 : 1;
+}
+
+// Kernel memory of all TCP sockets in bytes, as reported by '/proc/net/sockstat'
+static long sockstat_memory()
+{
+    FILE *file = fopen("/proc/net/sockstat", "r");
+    if (file == NULL)
+        return -1;
+    char line[256];
+    long pages = -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "TCP: inuse %*d orphan %*d tw %*d alloc %*d mem %ld", &pages) == 1)
+            break;
+    }
+    fclose(file);
+    return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+// Open connections through the loopback interface that send data nobody reads, first to a listener with
+// the default buffers and then to one with the minimal buffers, and compare the kernel socket memory
+static int sockstat_measure()
+{
+    bool ipv6 = global_family == AF_INET6;
+    int *clients = calloc((size_t) global_sockstat * 2, sizeof(int));
+    if (clients == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+    int *servers = clients + global_sockstat;
+    static char payload[SOCKSTAT_PAYLOAD];
+    int status = 0;
+
+    for (int minimal = 0; minimal < 2 && status == 0; ++minimal)
+    {
+        struct server_warning warning;
+        int listener = create_server(global_ports[0], global_family, SOMAXCONN, minimal, &warning);
+        if (listener < 0)
+        {
+            fprintf(stderr, "listen: %s\n", strerror(-listener));
+            status = 1;
+            break;
+        }
+        log_server_warning(&warning);
+        long before = sockstat_memory();
+        int count = 0;
+        for (; count < global_sockstat; ++count)
+        {
+            servers[count] = -1;
+            clients[count] = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+            if (clients[count] < 0)
+                break;
+            // the client's queue is not the honeypot's memory, so it's kept small in both runs
+            int value = LISTEN_BUFFER;
+            setsockopt(clients[count], SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+            struct sockaddr_in6 address6;
+            struct sockaddr_in address;
+            memset(&address6, 0, sizeof(address6));
+            memset(&address, 0, sizeof(address));
+            address6.sin6_family = AF_INET6;
+            address6.sin6_port = htons((uint16_t) global_ports[0]);
+            address6.sin6_addr = in6addr_loopback;
+            address.sin_family = AF_INET;
+            address.sin_port = htons((uint16_t) global_ports[0]);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int result = ipv6 ? connect(clients[count], (const struct sockaddr *) &address6, sizeof(address6)) :
+                connect(clients[count], (const struct sockaddr *) &address, sizeof(address));
+            struct pollfd wait = { listener, POLLIN, 0 };
+            if (result != 0 || poll(&wait, 1, 1000) != 1 || (servers[count] = accept(listener, NULL, NULL)) < 0)
+            {
+                close(clients[count]);
+                break;
+            }
+            send(clients[count], payload, sizeof(payload), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+
+        // let the loopback deliver what fits in the windows
+        struct timespec delay = { 0, 200000000 };
+        nanosleep(&delay, NULL);
+        long after = sockstat_memory();
+        int buffer = 0;
+        socklen_t length = sizeof(buffer);
+        if (count > 0)
+            getsockopt(servers[0], SOL_SOCKET, SO_RCVBUF, &buffer, &length);
+        printf("%-15s %d connections, receive buffer %d bytes: TCP memory %ld KiB before, %ld KiB after (%ld bytes per connection)\n",
+            minimal ? "minimal buffers" : "default buffers", count, buffer, before / 1024, after / 1024,
+            count > 0 ? (after - before) / count : 0);
+        if (count < global_sockstat)
+        {
+            perror("connect");
+            status = 1;
+        }
+
+        // reset the connections instead of leaving them in TIME_WAIT
+        struct linger linger = { 1, 0 };
+        for (int i = 0; i < count; ++i)
+        {
+            setsockopt(clients[i], SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+            close(clients[i]);
+            close(servers[i]);
+        }
+        close(listener);
+    }
+    free(clients);
+    return status;
+}
+
+static void parse_help(char * const *argv)
+{
+    fprintf(stderr, "Usage: %s -p port1 [ -p port2 ... ] [ -l log_file ] [ -4 | -6 ] [ -j jail ... ] [ -r rules_file ] [ options ]\n\n", argv[0]);
+    fputs("-p number     Listen on the specified port; this option may appear multiple times.\n"
+        "-l log_file   Path to the log file; if omitted, the log will be output to 'stderr'.\n"
+        "              Send SIGHUP to reopen the file after rotating it.\n"
+        "-4            Listen for IPv4 connections (any address); this is the default.\n"
+        "-6            Listen for IPv6 connections (any address); with '-4' too, listen for both\n"
+        "              on IPv6 sockets and log IPv4 sources without the '::ffff:' prefix.\n"
+        "-j jail       Log 'BAN address' once a source connects 'maxretry' times within 'findtime'\n"
+        "              seconds; the format is 'name:port1[,port2...]:maxretry:findtime[:bantime]'.\n"
+        "              This option may appear multiple times.\n"
+        "-r rules_file Path to the file with the rules that choose the action for each connection.\n"
+        "--log-level level\n"
+        "              Most verbose level written to the log: 'error', 'warning', 'info' (the default)\n"
+        "              or 'debug'.\n"
+        "--log-mmap megabytes\n"
+        "              Write the log file through memory mappings of preallocated segments with the\n"
+        "              specified size; the unused space is removed on rotation and shutdown.\n"
+        "--durability mode\n"
+        "              When the log file is forced to the disk: 'none' leaves it to the kernel (the\n"
+        "              default), 'interval' syncs it periodically from a background thread and\n"
+        "              'strict' syncs each batch of lines before waiting for more connections.\n"
+        "--sync-interval milliseconds\n"
+        "              Interval between the syncs of the 'interval' mode; the default is 1000.\n"
+        "--flight-recorder file\n"
+        "              Keep the last 8192 events in memory, including the messages filtered out by\n"
+        "              the log level, and write them to the file on SIGUSR2 or on a crash.\n",
+        stderr);
+    fputs("--anomaly z-score\n"
+        "              Log a warning when the connection rate of a port exceeds its usual rate by the\n"
+        "              specified number of standard deviations (e.g. 6).\n"
+        "--sink [format:]target\n"
+        "              Also send the log lines to 'stderr' or to the Unix stream socket 'unix:path', as\n"
+        "              'text' (the default) or 'json'; this option may appear multiple times.\n"
+        "--rdns host:port\n"
+        "              Add the PTR names of the sources to the logged connections, asking the DNS\n"
+        "              resolver at the specified address; the names are cached up to their TTL.\n"
+        "--rdns-timeout milliseconds\n"
+        "              How long a connection may wait for the name of its source; the default is 500.\n"
+        "--reputation score\n"
+        "              Keep a score per source that counts its connections and halves every half-life;\n"
+        "              connections from sources above the score are only counted instead of logged.\n"
+        "--reputation-half-life seconds\n"
+        "              Half-life of the reputation scores; the default is 3600 seconds.\n"
+        "--reputation-file path\n"
+        "              Write the 100 highest reputation scores to the specified path every minute.\n"
+        "--statsd host:port\n"
+        "              Send the number of connections per port and other metrics, aggregated over\n"
+        "              each interval, to the StatsD server at the specified address.\n"
+        "--statsd-interval seconds\n"
+        "              Interval between the StatsD flushes; the default is 10 seconds.\n"
+        "--firewall-file path\n"
+        "              Periodically write the banned sources, merged into the fewest prefixes, to the\n"
+        "              specified path as a firewall restore file; it's only replaced when they change.\n"
+        "--firewall-format format\n"
+        "              Syntax of the firewall file: 'nft' for 'nft -f' (the default) or 'ipset' for\n"
+        "              'ipset restore'.\n"
+        "--firewall-interval seconds\n"
+        "              Interval between the checks of the firewall file; the default is 10 seconds.\n"
+        "--stats seconds\n"
+        "              Measure the cost of accepting connections and of writing the log with performance\n"
+        "              counters (or the CPU time, if they are unavailable) and log it periodically.\n"
+        "--workload connections\n"
+        "              Open and reset the specified number of connections to the ports given by '-p'\n"
+        "              through the loopback interface (IPv4, IPv6 or both, as chosen by '-4' and '-6').\n"
+        "--proxy-from address[/length]\n"
+        "              Read the client's address from the PROXY protocol v2 header of the connections\n"
+        "              from the specified balancers; this option may appear up to 16 times.\n"
+        "--netns name  Listen in the network namespace with the specified name (in '/run/netns') or path\n"
+        "              instead of the current one, and append it to the connection lines; this option\n"
+        "              may appear multiple times.\n"
+        "--xdp interface[:queue]\n"
+        "              Instead of listening, capture the IPv4 SYNs to the ports given by '-p' that\n"
+        "              arrive on the receive queue (0 by default) of the interface with an AF_XDP socket;\n"
+          "              IPv6 isn't supported, so it can't be combined with '-6'.\n"
+        "--conntrack   Instead of listening, log the new TCP and UDP flows to the ports given by '-p'\n"
+        "              reported by conntrack, on every interface (needs CAP_NET_ADMIN).\n"
+        "--sockstat connections\n"
+        "              Measure the kernel socket memory held by the specified number of loopback\n"
+        "              connections that send data to the first port, with the default and the minimal\n"
+        "              buffers of the listeners.\n"
+        "--clock-info  Show the source of the fast clock used for timestamps, the cost of reading it\n"
+        "              and its drift from the wall clock between anchors.\n",
+        stderr);
+    fputs("--collector port\n"
+        "              Receive events from other instances on the specified port and log them in\n"
+        "              chronological order; the option '-p' becomes optional.\n"
+        "--sensor host:port\n"
+        "              Send the logged connections to the collector at the specified address.\n"
+        "--sensor-name name\n"
+        "              Name of this instance in the collector's log; the default is the host name.\n"
+        "--gossip address:port\n"
+        "              Exchange bans with a peer or multicast group; this option may appear multiple times.\n"
+        "--gossip-port port\n"
+        "              Local port for the ban exchange; the default is the port of the first address.\n"
+        "--gossip-key key_file\n"
+        "              Path to the file with the secret used to sign the bans; it's required for '--gossip'.\n"
+        "--sketch-file path\n"
+        "              Periodically write sketches of unique sources and top sources per port to the\n"
+        "              specified path, which may contain 'strftime' conversions (e.g. 'sketch-%Y%m%d%H%M').\n"
+        "--sketch-interval seconds\n"
+        "              Interval covered by each sketch file; the default is 300 seconds.\n"
+        "--merge-sketches output file1 [ file2 ... ]\n"
+        "              Merge sketch files from any number of instances and intervals into 'output'.\n"
+        "--show-sketches file1 [ file2 ... ]\n"
+        "              Merge sketch files and print the statistics; may be combined with '--merge-sketches'.\n"
+        "--archive output log_file1 [ log_file2 ... ]\n"
+        "              Convert log files to a compressed columnar archive.\n"
+        "--extract archive [ --from time ] [ --to time ]\n"
+        "              Write the lines of an archive to 'stdout', optionally only the ones in the\n"
+        "              specified time range ('YYYY-MM-DD HH:MM:SS[.mmm]'); both ends are included,\n"
+        "              and an end without milliseconds includes its whole second.\n",
+        stderr);
+}
+
+static bool parse_jail(char *spec)
+{
+    if (global_jail_count >= MAX_JAILS)
+        return false;
+    struct jail *jail = &global_jails[global_jail_count];
+
+    char *fields[5] = {NULL};
+    int count = 0;
+    char *saveptr = NULL;
+    for (char *field = strtok_r(spec, ":", &saveptr); field != NULL; field = strtok_r(NULL, ":", &saveptr))
+    {
+        if (count == 5)
+            return false;
+        fields[count++] = field;
+    }
+    if (count < 4)
+        return false;
+
+    jail->name = fields[0];
+    saveptr = NULL;
+    for (char *port = strtok_r(fields[1], ",", &saveptr); port != NULL; port = strtok_r(NULL, ",", &saveptr))
+    {
+        if (jail->port_count >= MAX_PORTS)
+            return false;
+        jail->ports[jail->port_count++] = atoi(port);
+    }
+    jail->max_retry = atoi(fields[2]);
+    int find_time = atoi(fields[3]);
+    int ban_time = count == 5 ? atoi(fields[4]) : 600;
+    if (jail->port_count == 0 || jail->max_retry <= 0 || find_time <= 0 || ban_time <= 0)
+        return false;
+
+    // the window is split in 'JAIL_BUCKETS' buckets
+    jail->bucket_width = ((int64_t) find_time * 1000 + JAIL_BUCKETS - 1) / JAIL_BUCKETS;
+    jail->ban_buckets = (uint32_t) (((int64_t) ban_time * 1000 + jail->bucket_width - 1) / jail->bucket_width);
+    ++global_jail_count;
+    return true;
 }
 
-static void signal_handler(int signum)
+enum long_option
 {
-    log_message(LOG_WARNING, "Caught signal %d!", signum);
-    global_running = false;
-}
+    OPTION_COLLECTOR = 256,
+    OPTION_SENSOR,
+    OPTION_SENSOR_NAME,
+    OPTION_GOSSIP,
+    OPTION_GOSSIP_PORT,
+    OPTION_GOSSIP_KEY,
+    OPTION_SKETCH_FILE,
+    OPTION_SKETCH_INTERVAL,
+    OPTION_MERGE_SKETCHES,
+    OPTION_SHOW_SKETCHES,
+    OPTION_ARCHIVE,
+    OPTION_EXTRACT,
+    OPTION_FROM,
+    OPTION_TO,
+    OPTION_LOG_MMAP,
+    OPTION_DURABILITY,
+    OPTION_SYNC_INTERVAL,
+    OPTION_FLIGHT_RECORDER,
+    OPTION_CLOCK_INFO,
+    OPTION_LOG_LEVEL,
+    OPTION_WORKLOAD,
+    OPTION_STATS,
+    OPTION_SOCKSTAT,
+    OPTION_XDP,
+    OPTION_CONNTRACK,
+    OPTION_NETNS,
+    OPTION_PROXY_FROM,
+    OPTION_STATSD,
+    OPTION_STATSD_INTERVAL,
+    OPTION_ANOMALY,
+    OPTION_REPUTATION,
+    OPTION_REPUTATION_HALF_LIFE,
+    OPTION_REPUTATION_FILE,
+    OPTION_FIREWALL_FILE,
+    OPTION_FIREWALL_FORMAT,
+    OPTION_FIREWALL_INTERVAL,
+    OPTION_RDNS,
+    OPTION_RDNS_TIMEOUT,
+    OPTION_SINK
+};
 
-static void parse_help(char * const *argv)
+static const struct option LONG_OPTIONS[] =
 {
-    fprintf(stderr, "Usage: %s -p port1 [ -p port2 ... ] [ -l log_file ] [ -4 | -6 ]\n\n", argv[0]);
-    fputs("-p number     Listen on the specified port; this option may appear multiple times.\n"
-        "-l log_file   Path to the log file; if omitted, the log will be output to 'stderr'.\n"
-        "-4            Listen for IPv4 connections (any address); this is the default.\n"
-        "-6            Listen for IPv6 connections (any address).\n",
-        stderr);
-}
+    { "collector", required_argument, NULL, OPTION_COLLECTOR },
+    { "sensor", required_argument, NULL, OPTION_SENSOR },
+    { "sensor-name", required_argument, NULL, OPTION_SENSOR_NAME },
+    { "gossip", required_argument, NULL, OPTION_GOSSIP },
+    { "gossip-port", required_argument, NULL, OPTION_GOSSIP_PORT },
+    { "gossip-key", required_argument, NULL, OPTION_GOSSIP_KEY },
+    { "sketch-file", required_argument, NULL, OPTION_SKETCH_FILE },
+    { "sketch-interval", required_argument, NULL, OPTION_SKETCH_INTERVAL },
+    { "merge-sketches", required_argument, NULL, OPTION_MERGE_SKETCHES },
+    { "show-sketches", no_argument, NULL, OPTION_SHOW_SKETCHES },
+    { "archive", required_argument, NULL, OPTION_ARCHIVE },
+    { "extract", required_argument, NULL, OPTION_EXTRACT },
+    { "from", required_argument, NULL, OPTION_FROM },
+    { "to", required_argument, NULL, OPTION_TO },
+    { "log-mmap", required_argument, NULL, OPTION_LOG_MMAP },
+    { "durability", required_argument, NULL, OPTION_DURABILITY },
+    { "sync-interval", required_argument, NULL, OPTION_SYNC_INTERVAL },
+    { "flight-recorder", required_argument, NULL, OPTION_FLIGHT_RECORDER },
+    { "clock-info", no_argument, NULL, OPTION_CLOCK_INFO },
+    { "log-level", required_argument, NULL, OPTION_LOG_LEVEL },
+    { "workload", required_argument, NULL, OPTION_WORKLOAD },
+    { "stats", required_argument, NULL, OPTION_STATS },
+    { "sockstat", required_argument, NULL, OPTION_SOCKSTAT },
+    { "xdp", required_argument, NULL, OPTION_XDP },
+    { "conntrack", no_argument, NULL, OPTION_CONNTRACK },
+    { "netns", required_argument, NULL, OPTION_NETNS },
+    { "proxy-from", required_argument, NULL, OPTION_PROXY_FROM },
+    { "statsd", required_argument, NULL, OPTION_STATSD },
+    { "statsd-interval", required_argument, NULL, OPTION_STATSD_INTERVAL },
+    { "anomaly", required_argument, NULL, OPTION_ANOMALY },
+    { "reputation", required_argument, NULL, OPTION_REPUTATION },
+    { "reputation-half-life", required_argument, NULL, OPTION_REPUTATION_HALF_LIFE },
+    { "reputation-file", required_argument, NULL, OPTION_REPUTATION_FILE },
+    { "firewall-file", required_argument, NULL, OPTION_FIREWALL_FILE },
+    { "firewall-format", required_argument, NULL, OPTION_FIREWALL_FORMAT },
+    { "firewall-interval", required_argument, NULL, OPTION_FIREWALL_INTERVAL },
+    { "rdns", required_argument, NULL, OPTION_RDNS },
+    { "rdns-timeout", required_argument, NULL, OPTION_RDNS_TIMEOUT },
+    { "sink", required_argument, NULL, OPTION_SINK },
+    { NULL, 0, NULL, 0 }
+};
 
 static bool parse_options(int argc, char * const *argv)
 {
     int option = 0;
-    while ((option = getopt(argc, argv, "p:l:46")) >= 0)
+    bool ipv4 = false, ipv6 = false;
+    while ((option = getopt_long(argc, argv, "p:l:46j:r:", LONG_OPTIONS, NULL)) >= 0)
     {
         switch (option)
         {
@@ -148,44 +6426,411 @@ static bool parse_options(int argc, char * const *argv)
                 global_log_file = optarg;
                 break;
             case '4':
-                global_family = AF_INET;
+                ipv4 = true;
                 break;
             case '6':
-                global_family = AF_INET6;
+                ipv6 = true;
+                break;
+            case 'j':
+                if (!parse_jail(optarg))
+                {
+                    fprintf(stderr, "%s: invalid jail '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case 'r':
+                global_rules_file = optarg;
+                break;
+            case OPTION_COLLECTOR:
+                global_collector_port = atoi(optarg);
+                break;
+            case OPTION_SENSOR:
+                global_sensor_target = optarg;
+                break;
+            case OPTION_SENSOR_NAME:
+                global_sensor_name = optarg;
+                break;
+            case OPTION_GOSSIP:
+                if (global_gossip_target_count >= MAX_GOSSIP_PEERS)
+                {
+                    fprintf(stderr, "%s: too many gossip peers; you must specify at most %d peers\n", argv[0], MAX_GOSSIP_PEERS);
+                    return false;
+                }
+                global_gossip_targets[global_gossip_target_count++] = optarg;
+                break;
+            case OPTION_GOSSIP_PORT:
+                global_gossip_port = atoi(optarg);
+                break;
+            case OPTION_GOSSIP_KEY:
+                global_gossip_key_file = optarg;
+                break;
+            case OPTION_SKETCH_FILE:
+                global_sketch_file = optarg;
+                break;
+            case OPTION_SKETCH_INTERVAL:
+                global_sketch_interval = atoi(optarg);
+                if (global_sketch_interval <= 0)
+                {
+                    fprintf(stderr, "%s: invalid sketch interval '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_MERGE_SKETCHES:
+                global_merge_output = optarg;
+                break;
+            case OPTION_SHOW_SKETCHES:
+                global_show_sketches = true;
+                break;
+            case OPTION_ARCHIVE:
+                global_archive_output = optarg;
+                break;
+            case OPTION_EXTRACT:
+                global_extract_input = optarg;
+                break;
+            case OPTION_FROM:
+                global_extract_from = optarg;
+                break;
+            case OPTION_TO:
+                global_extract_to = optarg;
+                break;
+            case OPTION_LOG_MMAP:
+                if (atoi(optarg) <= 0)
+                {
+                    fprintf(stderr, "%s: invalid segment size '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                global_log_segment = (size_t) atoi(optarg) * 1024 * 1024;
+                break;
+            case OPTION_DURABILITY:
+            {
+                int mode = 0;
+                while (mode <= DURABILITY_STRICT && strcmp(optarg, DURABILITY_MODES[mode]) != 0)
+                    ++mode;
+                if (mode > DURABILITY_STRICT)
+                {
+                    fprintf(stderr, "%s: invalid durability mode '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                global_durability = (enum durability) mode;
+                break;
+            }
+            case OPTION_SYNC_INTERVAL:
+                global_sync_interval = atoi(optarg);
+                if (global_sync_interval <= 0)
+                {
+                    fprintf(stderr, "%s: invalid sync interval '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_FLIGHT_RECORDER:
+                global_flight_file = optarg;
+                break;
+            case OPTION_CLOCK_INFO:
+                global_clock_info = true;
+                break;
+            case OPTION_STATS:
+                global_stats_interval = atoi(optarg);
+                if (global_stats_interval <= 0)
+                {
+                    fprintf(stderr, "%s: invalid stats interval '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_WORKLOAD:
+                global_workload = atol(optarg);
+                if (global_workload <= 0)
+                {
+                    fprintf(stderr, "%s: invalid number of connections '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_XDP:
+            {
+                char *queue = strchr(optarg, ':');
+                if (queue != NULL)
+                {
+                    *queue++ = '\0';
+                    global_xdp_queue = atoi(queue);
+                }
+                global_xdp_interface = optarg;
+                if (*optarg == '\0' || global_xdp_queue < 0)
+                {
+                    fprintf(stderr, "%s: invalid interface '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            }
+            case OPTION_ANOMALY:
+                global_anomaly_threshold = atof(optarg);
+                if (global_anomaly_threshold <= 0)
+                {
+                    fprintf(stderr, "%s: invalid anomaly threshold '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_REPUTATION:
+                global_reputation_threshold = atof(optarg);
+                if (global_reputation_threshold <= 0)
+                {
+                    fprintf(stderr, "%s: invalid reputation score '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_REPUTATION_HALF_LIFE:
+                global_reputation_half_life = atoi(optarg);
+                if (global_reputation_half_life <= 0)
+                {
+                    fprintf(stderr, "%s: invalid reputation half-life '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_REPUTATION_FILE:
+                global_reputation_file = optarg;
+                break;
+            case OPTION_SINK:
+            {
+                if (global_sink_count >= MAX_SINKS)
+                {
+                    fprintf(stderr, "%s: too many sinks; you must specify at most %d\n", argv[0], MAX_SINKS);
+                    return false;
+                }
+                struct sink *sink = &global_sinks[global_sink_count];
+                sink->format = SINK_TEXT;
+                sink->fd = -1;
+                for (int format = 0; format < SINK_FORMATS; ++format)
+                {
+                    size_t length = strlen(SINK_FORMAT_NAMES[format]);
+                    if (strncmp(optarg, SINK_FORMAT_NAMES[format], length) == 0 && optarg[length] == ':')
+                    {
+                        sink->format = (enum sink_format) format;
+                        optarg += length + 1;
+                    }
+                }
+                sink->target = optarg;
+                if (strcmp(optarg, "stderr") != 0 && (strncmp(optarg, "unix:", 5) != 0 || optarg[5] == '\0' ||
+                    strlen(optarg + 5) >= sizeof(((struct sockaddr_un *) NULL)->sun_path)))
+                {
+                    fprintf(stderr, "%s: invalid sink '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                global_sink_formats |= 1u << sink->format;
+                ++global_sink_count;
+                break;
+            }
+            case OPTION_RDNS:
+                global_rdns_target = optarg;
+                break;
+            case OPTION_RDNS_TIMEOUT:
+                global_rdns_timeout = atoi(optarg);
+                if (global_rdns_timeout <= 0)
+                {
+                    fprintf(stderr, "%s: invalid resolver timeout '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_FIREWALL_FILE:
+                global_firewall_file = optarg;
+                break;
+            case OPTION_FIREWALL_FORMAT:
+            {
+                int format = 0;
+                while (format <= FIREWALL_IPSET && strcmp(optarg, FIREWALL_FORMATS[format]) != 0)
+                    ++format;
+                if (format > FIREWALL_IPSET)
+                {
+                    fprintf(stderr, "%s: invalid firewall format '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                global_firewall_format = (enum firewall_format) format;
+                break;
+            }
+            case OPTION_FIREWALL_INTERVAL:
+                global_firewall_interval = atoi(optarg);
+                if (global_firewall_interval <= 0)
+                {
+                    fprintf(stderr, "%s: invalid firewall interval '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_STATSD:
+                global_statsd_target = optarg;
+                break;
+            case OPTION_STATSD_INTERVAL:
+                global_statsd_interval = atoi(optarg);
+                if (global_statsd_interval <= 0)
+                {
+                    fprintf(stderr, "%s: invalid StatsD interval '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                break;
+            case OPTION_PROXY_FROM:
+                if (global_proxy_source_count >= MAX_PROXY_SOURCES ||
+                    !parse_prefix(optarg, &global_proxy_sources[global_proxy_source_count], &global_proxy_lengths[global_proxy_source_count]))
+                {
+                    fprintf(stderr, "%s: invalid or too many balancer addresses '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                mask_address(&global_proxy_sources[global_proxy_source_count], global_proxy_lengths[global_proxy_source_count],
+                    &global_proxy_sources[global_proxy_source_count]);
+                ++global_proxy_source_count;
+                break;
+            case OPTION_NETNS:
+                if (global_namespace_count >= MAX_NAMESPACES)
+                {
+                    fprintf(stderr, "%s: too many network namespaces; you must specify at most %d\n", argv[0], MAX_NAMESPACES);
+                    return false;
+                }
+                global_namespaces[global_namespace_count++] = optarg;
+                break;
+            case OPTION_CONNTRACK:
+                global_conntrack = true;
+                break;
+            case OPTION_SOCKSTAT:
+                global_sockstat = atoi(optarg);
+                if (global_sockstat <= 0)
+                {
+                    fprintf(stderr, "%s: invalid number of connections '%s'\n", argv[0], optarg);
+                    return false;
+                }
                 break;
+            case OPTION_LOG_LEVEL:
+            {
+                int level = 0;
+                while (level <= LOG_DEBUG && strcasecmp(optarg, LOG_LEVELS[level]) != 0)
+                    ++level;
+                if (level > LOG_DEBUG)
+                {
+                    fprintf(stderr, "%s: invalid log level '%s'\n", argv[0], optarg);
+                    return false;
+                }
+                if (level > NB_MIN_LEVEL)
+                    fprintf(stderr, "%s: messages below level %s were removed at compile time\n", argv[0], LOG_LEVELS[NB_MIN_LEVEL]);
+                global_level = (enum log_level) level;
+                break;
+            }
             default:
                 parse_help(argv);
                 return false;
         }
     }
 
-    if (global_port_count == 0)
+    if (ipv6)
+        global_family = AF_INET6;
+    global_dual_stack = ipv4 && ipv6;
+
+    // tools that don't listen for connections
+    if (global_merge_output != NULL || global_show_sketches || global_archive_output != NULL)
+    {
+        if (optind < argc)
+            return true;
+        fprintf(stderr, "%s: missing input files\n", argv[0]);
+        return false;
+    }
+    if (global_extract_input != NULL || global_clock_info)
+        return true;
+    if (global_log_segment > 0 && global_log_file == NULL)
+    {
+        fprintf(stderr, "%s: '--log-mmap' requires a log file\n", argv[0]);
+        return false;
+    }
+    for (int s = 0; s < global_sink_count; ++s)
+    {
+        if (global_log_file == NULL && strcmp(global_sinks[s].target, "stderr") == 0)
+        {
+            fprintf(stderr, "%s: the log already goes to 'stderr' without a log file\n", argv[0]);
+            return false;
+        }
+    }
+
+    if (global_port_count == 0 && global_collector_port == 0)
     {
         fprintf(stderr, "%s: missing port number\n", argv[0]);
         return false;
     }
+    if (global_workload > 0 || global_sockstat > 0)
+        return true;
+    if (global_namespace_count > 0 && (global_xdp_interface != NULL || global_conntrack))
+    {
+        fprintf(stderr, "%s: '--netns' can't be combined with '--xdp' or '--conntrack'\n", argv[0]);
+        return false;
+    }
+    // the XDP program only parses IPv4 headers
+    if (global_xdp_interface != NULL && global_family == AF_INET6)
+    {
+        fprintf(stderr, "%s: '--xdp' only captures IPv4 SYNs and can't be combined with '-6'\n", argv[0]);
+        return false;
+    }
+
+    // find out which jails watch each port
+    for (int j = 0; j < global_jail_count; ++j)
+    {
+        for (int i = 0; i < global_jails[j].port_count; ++i)
+        {
+            for (int p = 0; p < global_port_count; ++p)
+            {
+                if (global_ports[p] == global_jails[j].ports[i])
+                    global_port_jails[p] |= (uint8_t) (1 << j);
+            }
+        }
+    }
 
     return true;
 }
 
-static int create_server(int port, int family, int max_connections)
+// Record the first option that couldn't be set, for the caller to log
+static void server_warn(struct server_warning *warning, const char *message)
+{
+    if (warning->message != NULL)
+        return;
+    warning->message = message;
+    warning->error = errno;
+}
+
+static void log_server_warning(const struct server_warning *warning)
+{
+    if (warning->message != NULL)
+        log_message(LOG_WARNING, "%s; %s", warning->message, strerror(warning->error));
+}
+
+// Return the listening socket or a negated 'errno'; no logging, since it also runs in the threads of
+// the network namespaces
+static int create_server(int port, int family, int max_connections, bool minimal_buffers, struct server_warning *warning)
 {
+    warning->message = NULL;
+    warning->error = 0;
     if (port <= 0 || port > 65535 || (family != AF_INET && family != AF_INET6))
         return -EINVAL;
     if (max_connections <= 0)
         max_connections = 5;
 
-    int conn = socket(family == AF_UNSPEC ? AF_INET : family, SOCK_STREAM, 0);
+    int conn = socket(family, SOCK_STREAM, 0);
     if (conn < 0)
-        return conn;
+        return -errno;
 
     int value = 1;
     if (setsockopt(conn, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0)
-        log_message(LOG_WARNING, "Unable to make the address reusable; %s", strerror(errno));
+        server_warn(warning, "Unable to make the address reusable");
+
+    // accepted connections inherit the buffers of the listener, and the honeypot never reads or writes
+    // a byte, so the smallest ones bound what each client can make the kernel hold (set before 'listen'
+    // for the window scale to follow them)
+    if (minimal_buffers)
+    {
+        value = LISTEN_BUFFER;
+        if (setsockopt(conn, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0 ||
+            setsockopt(conn, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0 ||
+            setsockopt(conn, IPPROTO_TCP, TCP_WINDOW_CLAMP, &value, sizeof(value)) < 0)
+            server_warn(warning, "Unable to shrink the socket buffers");
+    }
 
     int result = 0;
-    if (global_family == AF_INET6)
+    if (family == AF_INET6)
     {
+        // IPv4 connections arrive as IPv4-mapped addresses only in dual-stack mode
+        value = global_dual_stack ? 0 : 1;
+        if (setsockopt(conn, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value)) < 0)
+            server_warn(warning, "Unable to set the IPv6-only option");
+
         struct sockaddr_in6 addr;
         memset(&addr, 0, sizeof(addr));
         addr.sin6_family = AF_INET6;
@@ -203,20 +6848,88 @@ static int create_server(int port, int family, int max_connections)
         result = bind(conn, (const struct sockaddr *) &addr, sizeof(addr));
     }
 
-    if (result < 0)
+    if (result < 0 || listen(conn, max_connections) < 0 || !set_non_blocking(conn))
     {
+        int err = errno;
         close(conn);
-        return result;
+        return -err;
     }
 
-    result = listen(conn, max_connections);
-    if (result < 0)
+    return conn;
+}
+
+// Listeners of a network namespace, created by a thread that entered it
+struct netns_task
+{
+    int namespace;
+    struct pollfd *listeners;
+    int error;
+    struct server_warning warnings[MAX_PORTS];  // logged by the main thread
+};
+
+static void *netns_thread(void *argument)
+{
+    struct netns_task *task = argument;
+    const char *name = global_namespaces[task->namespace];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), strchr(name, '/') == NULL ? "/run/netns/%s" : "%s", name);
+    // only this thread changes namespace; the sockets stay in it after the thread exits
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || setns(fd, CLONE_NEWNET) != 0)
     {
-        close(conn);
-        return result;
+        task->error = errno;
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    close(fd);
+    for (int p = 0; p < global_port_count; ++p)
+    {
+        task->listeners[p].fd = create_server(global_ports[p], global_family, MAX_CONNECTIONS, true, &task->warnings[p]);
+        if (task->listeners[p].fd < 0)
+        {
+            task->error = -task->listeners[p].fd;
+            return NULL;
+        }
     }
+    return NULL;
+}
 
-    return conn;
+// Create the listeners of each namespace in turn, so only the main thread ever logs
+static bool netns_listen(struct pollfd *wait_list)
+{
+    for (int n = 0; n < global_namespace_count; ++n)
+    {
+        const char *name = global_namespaces[n];
+        const char *base = strrchr(name, '/');
+        snprintf(global_namespace_tags[n], sizeof(global_namespace_tags[n]), " (netns %s)", base == NULL ? name : base + 1);
+
+        struct netns_task task;
+        memset(&task, 0, sizeof(task));
+        task.namespace = n;
+        task.listeners = wait_list + global_listener_count;
+        for (int p = 0; p < global_port_count; ++p)
+        {
+            task.listeners[p].fd = -1;
+            task.listeners[p].events = POLLIN;
+            global_listener_ports[global_listener_count + p] = p;
+            global_listener_tags[global_listener_count + p] = global_namespace_tags[n];
+        }
+        global_listener_count += global_port_count;
+        pthread_t thread;
+        int result = pthread_create(&thread, NULL, netns_thread, &task);
+        if (result != 0 || pthread_join(thread, NULL) != 0 || task.error != 0)
+        {
+            log_message(LOG_ERROR, "Unable to listen in the network namespace '%s': %s", name, strerror(result != 0 ? result : task.error));
+            return false;
+        }
+        for (int p = 0; p < global_port_count; ++p)
+        {
+            log_server_warning(&task.warnings[p]);
+            log_message(LOG_INFO, "Listening to any address on the port %d%s", global_ports[p], global_namespace_tags[n]);
+        }
+    }
+    return true;
 }
 
 int main(int argc, char** argv)
@@ -226,38 +6939,105 @@ int main(int argc, char** argv)
         parse_help(argv);
         return 1;
     }
+    if (global_merge_output != NULL || global_show_sketches)
+        return merge_sketches(argc - optind, argv + optind);
+    if (global_archive_output != NULL)
+        return archive_logs(argc - optind, argv + optind);
+    if (global_extract_input != NULL)
+        return extract_logs();
+    if (global_clock_info)
+        return clock_info();
+    if (global_workload > 0)
+        return run_workload();
+    if (global_sockstat > 0)
+        return sockstat_measure();
 
-    if (global_log_file)
+    clock_start();
+
+    if (!log_open())
     {
-        global_log = fopen(global_log_file, "at");
-        if (global_log == NULL)
+        global_log = stderr;
+        int err = errno;
+        log_message(LOG_ERROR, "Unable to open log file '%s'", global_log_file);
+        log_error("IO error", err);
+        return 1;
+    }
+
+    if (!sync_start())
+        return 1;
+    if (global_sink_count > 0 && !sink_start())
+        return 1;
+    if (global_flight_file != NULL && !flight_start())
+        return 1;
+
+    char banner[64];
+    log_write(banner, (size_t) snprintf(banner, sizeof(banner), "\nnet-bouncer %d.%d.%d\n", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH));
+
+    // allocate the jails upfront so memory usage is bounded
+    random_bytes(global_hash_key, sizeof(global_hash_key));
+    for (int j = 0; j < global_jail_count; ++j)
+    {
+        global_jails[j].epoch = current_time_ms();
+        global_jails[j].entries = calloc(JAIL_SLOTS, sizeof(struct jail_entry));
+        if (global_jails[j].entries == NULL)
         {
-            global_log = stderr;
-            int err = errno;
-            log_message(LOG_ERROR, "Unable to open log file '%s'", global_log_file);
-            log_error("IO error", err);
+            log_message(LOG_ERROR, "Unable to allocate memory for jail '%s'", global_jails[j].name);
             return 1;
         }
     }
-    else
-        global_log = stderr;
-
-    fprintf(global_log, "\nnet-bouncer %d.%d.%d\n", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+    if (!load_rules(global_rules_file))
+        return 1;
+    if (global_collector_port != 0 && !collector_start())
+        return 1;
+    if (global_sensor_target != NULL && !sensor_start())
+        return 1;
+    if (global_gossip_target_count > 0 && !gossip_start())
+        return 1;
 
-    // create the server socket
-    struct pollfd wait_list[MAX_PORTS];
+    // create the server sockets, one per port in each namespace
+    struct pollfd wait_list[MAX_LISTENERS + MAX_WATCHES];
     memset(wait_list, 0, sizeof(wait_list));
-    for (int p = 0; global_port_count > p; ++p)
+    if (global_namespace_count > 0 && !netns_listen(wait_list))
+        return 1;
+    for (int p = 0; global_port_count > p && global_namespace_count == 0; ++p)
     {
         wait_list[p].events = POLLIN;
-        wait_list[p].fd = create_server(global_ports[p], global_family, MAX_CONNECTIONS);
+        global_listener_ports[p] = p;
+        global_listener_tags[p] = "";
+        global_listener_count = p + 1;
+        if (global_xdp_interface != NULL || global_conntrack)
+        {
+            // 'poll' ignores the listeners; the connections are observed instead
+            wait_list[p].fd = -1;
+            continue;
+        }
+        struct server_warning warning;
+        wait_list[p].fd = create_server(global_ports[p], global_family, MAX_CONNECTIONS, true, &warning);
         if (wait_list[p].fd < 0)
         {
-            log_error("Unable to create socket server", wait_list[p].fd);
+            log_error("Unable to create socket server", -wait_list[p].fd);
             return 1;
         }
+        log_server_warning(&warning);
         log_message(LOG_INFO, "Listening to any address on the port %d", global_ports[p]);
     }
+    if (global_xdp_interface != NULL && !xdp_start())
+        return 1;
+    if (global_conntrack && !conntrack_start())
+        return 1;
+    if (global_sketch_file != NULL && !sketch_start())
+        return 1;
+    if (global_statsd_target != NULL && !statsd_start())
+        return 1;
+    if (global_anomaly_threshold > 0)
+        anomaly_start();
+    if ((global_reputation_threshold > 0 || global_reputation_file != NULL) && !reputation_start())
+        return 1;
+    if (global_rdns_target != NULL && !rdns_start())
+        return 1;
+    // the file starts empty, so the firewall doesn't keep the bans of a previous run
+    if (global_firewall_file != NULL)
+        firewall_export(current_time_ms());
 
     // capture signals to terminate the program
     struct sigaction action;
@@ -266,42 +7046,132 @@ int main(int argc, char** argv)
     sigaction(SIGTERM, &action, NULL);
     sigaction(SIGABRT, &action, NULL);
     sigaction(SIGINT, &action, NULL);
+    // reopen the log file after rotation
+    action.sa_handler = reopen_handler;
+    sigaction(SIGHUP, &action, NULL);
+
+    if (global_stats_interval > 0)
+    {
+        profile_start();
+        global_stats_deadline = current_time_ms() + global_stats_interval * 1000;
+    }
+
+    // the accept loop for the listening mode and the enabled features
+    accept_loop accept_ready = accept_select();
 
     // keep accepting clients until the program finishes
     while (global_running)
     {
-        int events = poll(wait_list, (nfds_t) global_port_count, -1);
-        if (events < 0)
+        int watch_count = global_watch_count;
+        for (int i = 0; i < watch_count; ++i)
+        {
+            wait_list[global_listener_count + i].fd = global_watches[i].fd;
+            wait_list[global_listener_count + i].events = global_watches[i].events;
+            wait_list[global_listener_count + i].revents = 0;
+        }
+        // group commit of the lines logged while handling the previous events
+        if (global_stats_interval > 0)
+        {
+            profile_begin(STAGE_LOG);
+            log_commit();
+            profile_end(STAGE_LOG);
+        }
+        else
+            log_commit();
+        int events = poll(wait_list, (nfds_t) (global_listener_count + watch_count), poll_timeout(current_time_ms()));
+        int64_t woke = global_statsd != NULL ? clock_fast_ns() : 0;
+        int ready = events;
+        if (events < 0 && errno != EINTR)
         {
             log_error("Error waiting connection", errno);
             break;
         }
+        if (!global_running)
+            break;
+        if (global_reopen)
+        {
+            global_reopen = 0;
+            log_close();
+            if (!log_open())
+            {
+                int err = errno;
+                global_log = stderr;
+                log_message(LOG_ERROR, "Unable to reopen log file '%s'", global_log_file);
+                log_error("IO error", err);
+            }
+            else
+                log_message(LOG_INFO, "Log file reopened");
+        }
+        if (global_flight_dump)
+        {
+            global_flight_dump = 0;
+            int count = flight_dump();
+            if (count < 0)
+                log_error("Unable to dump the flight recorder", errno);
+            else
+                log_message(LOG_INFO, "Dumped %d events of the flight recorder to '%s'", count, global_flight_file);
+        }
+        if (events < 0)
+            continue;
+        run_deadlines(current_time_ms());
 
-        for (int p = 0; p <= global_port_count && events > 0; ++p)
+        // the callbacks may add or remove watches, so look for them by descriptor
+        for (int i = global_listener_count; i < global_listener_count + watch_count && events > 0; ++i)
         {
-            if ((wait_list[p].revents & POLLIN) == 0)
+            if (wait_list[i].revents == 0)
                 continue;
             --events;
-            wait_list[p].revents = 0;
+            struct watch *watch = watch_find(wait_list[i].fd);
+            if (watch != NULL)
+                watch->callback(wait_list[i].fd, wait_list[i].revents);
+        }
 
-            struct sockaddr_in6 address;
-            socklen_t len = sizeof(address);
-            int client = accept(wait_list[p].fd, (struct sockaddr *) &address, &len);
-            if (client < 0)
-            {
-                log_error("Error accepting connection", errno);
-                break;
-            }
-            // log and close the connection
-            if (global_family == AF_INET6)
-                log_connection_ipv6(LOG_INFO, (const struct sockaddr_in6 *) &address, global_ports[p]);
-            else
-                log_connection_ipv4(LOG_INFO, (const struct sockaddr_in *) &address, global_ports[p]);
-            close(client);
+        if (global_stats_interval > 0)
+        {
+            profile_begin(STAGE_ACCEPT);
+            accept_ready(wait_list, events);
+            profile_end(STAGE_ACCEPT);
         }
+        else
+            accept_ready(wait_list, events);
+        if (global_statsd != NULL && ready > 0)
+            statsd_time(&global_statsd->wakeup, (uint64_t) (clock_fast_ns() - woke));
     }
 
+    if (global_stop_signal != 0)
+        log_message(LOG_WARNING, "Caught signal %d!", (int) global_stop_signal);
+    rdns_stop();
     for (int p = 0; p < global_port_count; ++p)
-        close(wait_list[p].fd);
+        log_message(LOG_INFO, "Received %" PRIu64 " connections on the port %d", global_hits[p], global_ports[p]);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        log_message(LOG_INFO, "Used %ld.%06ld s of user CPU time and %ld.%06ld s of system CPU time",
+            (long) usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec, (long) usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec);
+    sink_stop();
+    tarpit_expire(INT64_MAX);
+    proxy_expire(INT64_MAX);
+    statsd_stop();
+    reputation_stop();
+    xdp_stop();
+    conntrack_stop();
+    sensor_stop();
+    collector_stop();
+    gossip_stop();
+    free(global_bans);
+    sketch_stop();
+    profile_stop();
+    sync_stop();
+    log_close();
+    free(global_flight);
+    for (int l = 0; l < global_listener_count; ++l)
+    {
+        if (wait_list[l].fd >= 0)
+            close(wait_list[l].fd);
+    }
+    for (int j = 0; j < global_jail_count; ++j)
+        free(global_jails[j].entries);
+    for (int i = 0; i < global_rule_node_count; ++i)
+        free(global_rule_nodes[i].actions);
+    free(global_rule_nodes);
     return 0;
 }